@@ -10,7 +10,15 @@
 *			and space. 
 *
 *	SOCKET:		This program provides a flexible function for 
-*			creating sockets.
+*			creating sockets, and one for Unix sockets, wich 
+*			clients on the same host can use instead.
+*
+*	FRAMES:		A receive buffer that reads large chunks from a 
+*			socket and splits them into [type][length][text] 
+*			frames. A frame that is only partly received stays 
+*			in the buffer until the rest of it arrives. The length
+*			is one byte in protocol version 1, and four bytes in
+*			network byte order in version 2.
 *
 *	SIGNAL HANDLER:	One function for initializing the signal handler
 *			and one for the actual signal handler that calls
@@ -24,9 +32,15 @@
 
 #include "communication.h"
 
+int port, sigHandlerCalled, socketConnection;
+__thread int testValue;		//Every server thread has its own
+__thread struct sockaddr_in serverAddr;
+__thread socklen_t addr_size;
+
 /*This function reads from file descriptor and outputs appropriate
-*error message if it fails. If it reads fewer bytes that it was supposed
-*to then i treat that as an error.
+*error message if it fails. A short read, wich is normal on sockets and
+*pipes, is followed by another read for the rest. If the other end closes
+*before all the bytes are read then i treat that as an error.
 *
 *Input: 
 *	a: file-descriptor
@@ -37,23 +51,24 @@
 */
 int readFromFileDescriptor(int fd, char *buffer, size_t length) {
 	
-	int testValue = read(fd, buffer, length);
+	size_t done = 0;
+	while (done < length) {
 
-	if (testValue <= 0) {
-		if (testValue == -1) perror("read()");
-		return -1;
-	}
-	if (testValue != (int)length) {
-		printf("Only read %d of %d bytes requested\n", testValue, (int)length);
-		return -1;
+		ssize_t testValue = read(fd, buffer + done, length - done);
+		if (testValue <= 0) {
+			if (testValue == -1 && errno == EINTR) continue;
+			if (testValue == -1) perror("read()");
+			else if (done > 0) printf("Only read %d of %d bytes requested\n", (int)done, (int)length);
+			return -1;
+		}
+		done += testValue;
 	}
-
 	return 0;
 }
 
 /*This function sends a given message to a given file descriptor, and tests it for errors. 
-*If there is an error an appropriate message is outputed. If it writes fewer bytes that it 
-*was supposed to then i treat that as an error.
+*If there is an error an appropriate message is outputed. A short write is followed by 
+*another write for the rest.
 *
 *Input: 
 *	a: file descriptor
@@ -65,17 +80,44 @@ int readFromFileDescriptor(int fd, char *buffer, size_t length) {
 */
 int writeToFileDescriptor(int fd, char *msg, size_t length) {
 
-	int testValue = write(fd, msg, length);
-	if (testValue <= 0) {
-		if (testValue == -1) perror("write()");
-		return -1;
+	size_t done = 0;
+	while (done < length) {
+
+		ssize_t testValue = write(fd, msg + done, length - done);
+		if (testValue <= 0) {
+			if (testValue == -1 && errno == EINTR) continue;
+			if (testValue == -1) perror("write()");
+			else printf("Only wrote %d of %d bytes requested\n", (int)done, (int)length);
+			return -1;
+		}
+		done += testValue;
 	}
-	if (testValue != (int)length) {
-		printf("Only wrote %d of %d bytes requested\n", testValue, (int)length);
+	return 0;
+}
+
+/*This function creates a Unix socket and fills in its address, and prints an error
+*message if that fails or the path doesn't fit in the address.
+*
+*Input: 
+*		a: path of the socket
+*		b: where the address is stored
+*
+*Return:
+*the socket, and -1 for error.
+*/
+int createLocalSocket(char *path, struct sockaddr_un *addr) {
+
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		printf("The socket path is longer than %d characters\n", (int) sizeof(addr->sun_path) - 1);
 		return -1;
 	}
+	strcpy(addr->sun_path, path);
 
-	return 0;
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == -1) perror("socket()");
+	return sock;
 }
 
 /*This function creates the socket, and prints an error message if
@@ -146,3 +188,93 @@ int init_sig_handler() {
 	}
 	return 0;
 }
+
+/*This function reads as much as there is room for in the receive buffer with a single
+*recv(). Before that a partly received frame at the end of the buffer is moved to the
+*front, so that a frame is always stored in one piece. A frame that is larger than the
+*whole buffer is treated as an error.
+*
+*Input: 
+*	a: socket
+*	b: receive buffer
+*
+*Return: 
+*number of bytes received, 0 if the other end closed, -1 for error
+*/
+int fillRecvBuffer(int fd, struct recvBuffer *rb) {
+
+	if (rb->start > 0) {
+		memmove(rb->data, rb->data + rb->start, rb->end - rb->start);
+		rb->end -= rb->start;
+		rb->start = 0;
+	}
+	if (rb->end == sizeof(rb->data)) {
+		printf("A frame is larger than the receive buffer (%d bytes)\n", RECVBUFSIZE);
+		return -1;
+	}
+
+	for (;;) {
+		ssize_t testValue = recv(fd, rb->data + rb->end, sizeof(rb->data) - rb->end, 0);
+		if (testValue == -1) {
+			if (errno == EINTR) continue;
+			perror("recv()");
+			return -1;
+		}
+		rb->end += testValue;
+		return testValue;
+	}
+}
+
+/*This function takes the next complete frame out of the receive buffer. The frame is
+*not copied, the pointer is into the buffer and stays valid until the buffer is filled
+*again.
+*
+*Input: 
+*	a: receive buffer
+*	b: where the length of the whole frame is stored
+*
+*Return: 
+*pointer to the frame, NULL if there is no complete frame in the buffer
+*/
+char * nextFrame(struct recvBuffer *rb, size_t *length) {
+
+	size_t available = rb->end - rb->start;
+	if (available < rb->headerLen) return NULL;
+
+	if (rb->headerLen == V2HEADER) *length = V2HEADER + (size_t) getLength(rb->data + rb->start + 1);
+	else *length = V1HEADER + (unsigned char) rb->data[rb->start+1];
+	if (available < *length) return NULL;
+
+	char *frame = rb->data + rb->start;
+	rb->start += *length;
+	return frame;
+}
+
+/*This function stores a length as four bytes in network byte order.
+*
+*Input: 
+*	a: where the length is stored
+*	b: length
+*
+*Return: none
+*/
+void putLength(char *p, uint32_t length) {
+
+	uint32_t n = htonl(length);
+	memcpy(p, &n, sizeof(n));
+}
+
+/*This function reads a length stored as four bytes in network byte order.
+*
+*Input: 
+*	a: where the length is stored
+*
+*Return: 
+*the length
+*/
+uint32_t getLength(char *p) {
+
+	uint32_t n;
+	memcpy(&n, p, sizeof(n));
+	return ntohl(n);
+}
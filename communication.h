@@ -8,6 +8,7 @@
 *H*/
 
 #include <arpa/inet.h>
+#include <errno.h>
 #include <netinet/in.h>
 #include <signal.h>
 #include <stdint.h>
@@ -15,23 +16,63 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #define GETJOB ((char) 'G')
+#define GETRANGE ((char) 'R')	//Also the frame that answers it
 #define NORMALTERMINATE ((char) 'T')
 #define ERRORTERMINATE ((char) 'E')
+#define HELLO ((char) 'H')
+#define COMPRESSED ((char) 'Z')
+#define FILTER ((char) 'F')
+#define RECORDS ((char) 'B')	//Records as they are in the job file
 #define MAXJOBS 255
+#define MAXJOBSV2 4096		//Batch size klient asks for, the protocol allows 2^32-1
+#define PROTOCOLVERSION 2
+#define V1HEADER 2		//[type][8 bit length]
+#define V2HEADER 5		//[type][32 bit length]
+#define HELLOLENGTH 6		//[HELLO][version][32 bit features]
+#define PACKHEADER 9		//[COMPRESSED][32 bit length][32 bit length uncompressed]
+#define FEATURECOMPRESS 0x1	//Batches may come as compressed frames
+#define FEATURESHM 0x2		//Batches come through shared memory, on a Unix socket
+#define FEATUREFILTER 0x4	//The server understands FILTER messages
+#define FEATURERANGE 0x8	//The server understands GETRANGE requests
+#define FEATURERECORDS 0x10	//Jobs may come as RECORDS frames, not with compression
+#define MAXRECORDS 32768	//Bytes of records in one RECORDS frame, half a receive buffer
+#define RANGELENGTH 18		//[GETRANGE][unit][64 bit first][64 bit count]
+#define RANGEFRAME 9		//[GETRANGE][32 bit length 4][32 bit number of jobs that follow]
+#define RANGEJOBS 0		//Range units: job numbers
+#define RANGEBYTES 1		//Byte offsets, the jobs whose records start in the range
+#define FILTERBODY 33		//[32 byte mask of job types][mode], followed by the text
+#define MAXFILTERTEXT 255
+#define FILTERTYPES 0		//Filter modes: only the types
+#define FILTERPREFIX 1		//The jobtext starts with the text
+#define FILTERCONTAINS 2	//The jobtext contains the text
 #define NOTCONNECTED 0
 #define CONNECTED 1
+#define RECVBUFSIZE 65536
 
-int port, testValue, sigHandlerCalled, socketConnection;
-struct sockaddr_in serverAddr;
-socklen_t addr_size;
+struct recvBuffer {
+	char data[RECVBUFSIZE];
+	size_t start, end;	//The unparsed bytes are data[start] to data[end-1]
+	size_t headerLen;	//V1HEADER or V2HEADER
+};
+
+extern int port, sigHandlerCalled, socketConnection;
+extern __thread int testValue;
+extern __thread struct sockaddr_in serverAddr;
+extern __thread socklen_t addr_size;
 
 int readFromFileDescriptor(int fd, char *buffer, size_t length);
 int writeToFileDescriptor(int fd, char *msg, size_t length);
 int createSocket(char *adr, int prt);
+int createLocalSocket(char *path, struct sockaddr_un *addr);
 int init_sig_handler();
 void sig_handler(int signo);
 int checkArguments(int argc, char *h, char *p);
 void terminator(char msg);
+int fillRecvBuffer(int fd, struct recvBuffer *rb);
+char * nextFrame(struct recvBuffer *rb, size_t *length);
+void putLength(char *p, uint32_t length);
+uint32_t getLength(char *p);
@@ -0,0 +1,110 @@
+/*H**********************************************************************
+* FILENAME:		filter.c
+*
+* COMPILE:		Make
+*
+* NOTES:
+*	MESSAGE:	A FILTER message is [FILTER][32 bit length] followed by
+*			a bitmask of the job types, the mode and the text. It
+*			is a version 2 message, and holds for every GETJOB after
+*			it.
+*
+*	SEARCH:		With FILTERCONTAINS the text is searched for 16 bytes at
+*			a time with SSE2. A block is compared with the first byte
+*			of the text, and the block the length of the text further
+*			on with its last byte, so only where both match memcmp
+*			is called. The search never reads past the end of the
+*			jobtext, wich may be the end of the mapped file. Without
+*			SSE2 memmem is used.
+*
+*
+* AUTHOR: 		15119
+*
+*H*/
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include "communication.h"
+#include "filter.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*This function reads the body of a FILTER message, wich is everything after its length.
+*
+*Input:
+*	a: filter to fill in
+*	b: body
+*	c: length of the body
+*
+*Return:
+*0 on success, -1 if it isn't a valid filter
+*/
+int filterDecode(struct jobFilter *f, char *body, size_t length) {
+
+	if (length < FILTERBODY || length - FILTERBODY > MAXFILTERTEXT) return -1;
+	memcpy(f->types, body, sizeof(f->types));
+	f->mode = (unsigned char) body[sizeof(f->types)];
+	if (f->mode != FILTERTYPES && f->mode != FILTERPREFIX && f->mode != FILTERCONTAINS) return -1;
+	f->textLen = length - FILTERBODY;
+	memcpy(f->text, body + FILTERBODY, f->textLen);
+	return 0;
+}
+
+/*This function checks if a job passes a filter.
+*
+*Input:
+*	a: filter
+*	b: job type
+*	c: jobtext
+*	d: textlength
+*
+*Return:
+*1 if it passes, 0 if it doesn't
+*/
+int filterMatch(struct jobFilter *f, char type, char *text, size_t length) {
+
+	unsigned char t = type;
+	if (!(f->types[t >> 3] & (1 << (t & 7)))) return 0;
+	if (f->mode == FILTERPREFIX) return length >= f->textLen && memcmp(text, f->text, f->textLen) == 0;
+	if (f->mode == FILTERCONTAINS) return findText(text, length, f->text, f->textLen) != NULL;
+	return 1;
+}
+
+/*This function finds the first place a pattern is in a text. Neither has to end with a
+*nullbyte.
+*
+*Input:
+*	a: text
+*	b: length of the text
+*	c: pattern
+*	d: length of the pattern
+*
+*Return:
+*where the pattern starts in the text, NULL if it isn't in it
+*/
+char * findText(char *text, size_t length, char *pattern, size_t patternLen) {
+
+	if (patternLen == 0) return text;
+	if (patternLen > length) return NULL;
+	size_t pos = 0;
+
+#ifdef __SSE2__
+	__m128i first = _mm_set1_epi8(pattern[0]);
+	__m128i last = _mm_set1_epi8(pattern[patternLen - 1]);
+	for (; pos + patternLen - 1 + 16 <= length; pos += 16) {
+
+		__m128i a = _mm_loadu_si128((__m128i *) (text + pos));
+		__m128i b = _mm_loadu_si128((__m128i *) (text + pos + patternLen - 1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+		while (mask != 0) {
+			int bit = __builtin_ctz(mask);
+			if (memcmp(text + pos + bit, pattern, patternLen) == 0) return text + pos + bit;
+			mask &= mask - 1;
+		}
+	}
+#endif
+	return memmem(text + pos, length - pos, pattern, patternLen);
+}
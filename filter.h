@@ -0,0 +1,23 @@
+/*H**********************************************************************
+* FILENAME:	filter.h
+*
+* NOTES:	The filter a klient can send to the server, so that only the
+*		jobs it wants are sent to it: a set of job types, and a text
+*		the jobtext has to start with or contain.
+*
+* AUTHOR: 	15119
+*
+*H*/
+
+#include <stddef.h>
+
+struct jobFilter {
+	unsigned char types[32];	//One bit for every job type
+	int mode;			//FILTERTYPES, FILTERPREFIX or FILTERCONTAINS
+	size_t textLen;
+	char text[MAXFILTERTEXT];
+};
+
+int filterDecode(struct jobFilter *f, char *body, size_t length);
+int filterMatch(struct jobFilter *f, char type, char *text, size_t length);
+char * findText(char *text, size_t length, char *pattern, size_t patternLen);
@@ -0,0 +1,783 @@
+/*H**********************************************************************
+* FILENAME:		jobfile.c
+*
+* COMPILE:		Make
+*
+* NOTES: 	
+*	MAPPING:	The job file is mapped into memory once, so serving
+*			a job is a plain memory access instead of two read()
+*			calls. The kernel is told that the mapping is read 
+*			sequentially, which makes it read ahead aggressively
+*			and drop pages behind the cursor first, so job files
+*			larger than memory stay usable.
+*
+*	INDEX:		While opening, the file is walked header by header and
+*			the offset of every record is stored. Like before, the 
+*			jobs end at the first record with text length 0 or at 
+*			a record that is cut off by the end of the file.
+*
+*	SIDECAR:	jobindex writes the index to <file>.idx, with the size
+*			and modification time of the job file, the number of 
+*			jobs of every type and a crc32 of every block of 
+*			INDEXBLOCK jobs. If the sidecar matches the job file it
+*			is mapped and used as it is, so opening a big file 
+*			doesn't walk it. Otherwise the file is walked as before.
+*			Every offset in it is checked to be after the one before
+*			it by a whole record and inside the file, wich only reads
+*			the sidecar, so a broken sidecar never makes a record go
+*			outside the mapping.
+*			The checksums are only checked by jobindex -v, since
+*			checking them means reading the whole file.
+*
+*	RESUME:		With JOBRESUME the cursor is saved in <file>.state by
+*			jobFileCheckpoint, with the size and modification time 
+*			of the job file and a crc32 of the STATEWINDOW bytes on
+*			each side of the record of the saved job, in the field 
+*			that older state files leave 0. The next open starts 
+*			from there if the job file hasn't changed, or if it is 
+*			bigger and those bytes are the same, so a file that was
+*			only appended to since still resumes. The state is saved
+*			again when the file grew, even if the cursor didn't 
+*			move. Without a sidecar
+*			only the jobs from there on are indexed, so the part of 
+*			the file that is done is never walked again.
+*
+*	PARTS:		The jobs can be split in equal ranges, so that server
+*			threads that each open the same file serve disjoint 
+*			parts of it, with a cursor of their own and nothing
+*			shared between them.
+*
+*	TAKEN:		A job after the cursor can be taken out of turn, by a
+*			klient with a filter. It is marked in a bitmap, and the
+*			cursor skips it when it gets there, so every job is still
+*			taken once. The bitmap is only allocated when the first
+*			job is taken out of turn.
+*
+*	GROWING:	A job file that is appended to while it is served is
+*			mapped again with mremap(), wich may move the mapping,
+*			and the walk goes on from the end of the last complete
+*			record. A record at the end that is only half written
+*			is left out until the rest of it is there, so the same
+*			place is looked at again the next time. An index from 
+*			the sidecar is copied to the heap first, since it can't
+*			grow. A file that got smaller, because it was truncated
+*			or rotated with copytruncate, is not mapped again, but
+*			its cursor is stopped and it is marked as shrunk, since
+*			reading the mapping past the new end raises SIGBUS.
+*
+*
+* AUTHOR: 		15119
+*
+*H*/
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "jobfile.h"
+
+int buildIndex(struct jobFile *jf, size_t job, size_t pos);
+int walkRecords(struct jobFile *jf);
+int copyIndex(struct jobFile *jf);
+int loadIndex(struct jobFile *jf, char *name);
+char * sidecarName(char *name, char *suffix);
+int loadState(struct jobFile *jf, char *name, struct jobState *st);
+uint32_t blockChecksum(struct jobFile *jf, size_t block);
+uint32_t aroundChecksum(struct jobFile *jf, uint64_t offset, uint64_t fileSize);
+int offsetsValid(uint64_t *offsets, size_t jobCount, size_t mapLen);
+
+/*This function opens and maps the job file with the given name and builds the
+*index of its records, or loads it from the sidecar if JOBINDEX is set and the sidecar
+*belongs to this version of the file. With JOBRESUME the cursor starts at the job in
+*the state file, and if there is no sidecar the index starts there as well. If any of
+*it fails an error message is printed.
+*
+*Input: 
+*	a: job file to fill in
+*	b: name of the file
+*	c: JOBINDEX and/or JOBRESUME
+*
+*Return: 
+*the file descriptor on success, -1 for error
+*/
+int jobFileOpen(struct jobFile *jf, char *name, int flags) {
+
+	struct stat st;
+	struct jobState state = {.job = 0};
+	memset(jf, 0, sizeof(struct jobFile));
+	jf->stateFd = jf->watch = -1;
+	if ((jf->name = strdup(name)) == NULL) {
+		perror("strdup()");
+		jf->fd = -1;
+		return -1;
+	}
+
+	if ((jf->fd = open(name, O_RDONLY)) == -1) {
+		perror("open()");
+		return -1;
+	}
+	if (fstat(jf->fd, &st) == -1) {
+		perror("fstat()");
+		jobFileClose(jf);
+		return -1;
+	}
+	jf->fileTime = (uint64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+
+	if (st.st_size > 0) {
+		jf->mapLen = st.st_size;
+		jf->map = mmap(NULL, jf->mapLen, PROT_READ, MAP_SHARED, jf->fd, 0);
+		if (jf->map == MAP_FAILED) {
+			perror("mmap()");
+			jf->map = NULL;
+			jobFileClose(jf);
+			return -1;
+		}
+		madvise(jf->map, jf->mapLen, MADV_SEQUENTIAL);
+	}
+
+	if ((flags & JOBRESUME) && loadState(jf, name, &state) == -1) {
+		jobFileClose(jf);
+		return -1;
+	}
+
+	if ((flags & JOBINDEX) && loadIndex(jf, name) == 0) {
+		if (state.job > jf->jobCount || jf->offsets[state.job] != state.offset) state.job = 0;
+	}
+	else if (buildIndex(jf, state.job, state.offset) == -1) {
+		jobFileClose(jf);
+		return -1;
+	}
+	jf->next = jf->savedJob = state.job;
+	jf->savedSize = state.fileSize;
+	jf->stop = jf->jobCount;
+	return jf->fd;
+}
+
+/*This function limits the cursor to one of parts equal ranges of the jobs. Where a
+*range starts and stops only depends on the number of jobs, so every part is served by
+*exactly one of the threads that open the file.
+*
+*Input: 
+*	a: job file
+*	b: the part, from 0
+*	c: number of parts
+*
+*Return: none
+*/
+void jobFilePart(struct jobFile *jf, int part, int parts) {
+
+	size_t first = jf->jobCount * part / parts;
+	jf->stop = jf->jobCount * (part + 1) / parts;
+	if (jf->next < first) jf->next = first;
+	if (jf->next > jf->stop) jf->next = jf->stop;
+}
+
+/*This function makes a job file that shares the mapping, descriptor and index of an open
+*one, so they are only built once and read by both. Only the cursor, where it stops and
+*the jobs that are taken out of turn are its own. If that fails an error message is printed.
+*
+*Input: 
+*	a: job file to fill in
+*	b: the open job file
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int jobFileShare(struct jobFile *jf, struct jobFile *from) {
+
+	*jf = *from;
+	jf->shared = 1;
+	jf->stateFd = jf->watch = -1;
+	jf->taken = NULL;
+	jf->takenCap = 0;
+	if ((jf->name = strdup(from->name)) == NULL) {
+		perror("strdup()");
+		return -1;
+	}
+	return 0;
+}
+
+/*This function takes a job. The job under the cursor moves the cursor past it and the
+*jobs after it that are already taken. Any other job is marked in the bitmap. If the 
+*bitmap can't be allocated an error message is printed.
+*
+*Input: 
+*	a: job file
+*	b: number of the job, from the cursor on
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int jobFileTake(struct jobFile *jf, size_t job) {
+
+	if (job != jf->next) {
+		if (job >= jf->takenCap) {
+			size_t cap = jf->jobCount > job ? jf->jobCount : job + 1;
+			unsigned char *taken = realloc(jf->taken, (cap + 7) / 8);
+			if (taken == NULL) {
+				perror("realloc()");
+				return -1;
+			}
+			memset(taken + (jf->takenCap + 7) / 8, 0, (cap + 7) / 8 - (jf->takenCap + 7) / 8);
+			jf->taken = taken;
+			jf->takenCap = cap;
+		}
+		jf->taken[job >> 3] |= 1 << (job & 7);
+		return 0;
+	}
+	do jf->next++;
+	while (jf->next < jf->stop && jobFileTaken(jf, jf->next));
+	return 0;
+}
+
+/*This function gives back a job that was taken, so it is taken again. A job after the 
+*cursor is taken out of the bitmap. For a job before the cursor the cursor moves back 
+*to it, and the jobs between it and where the cursor was are marked as taken, so only 
+*the jobs that are given back are taken again. Jobs have to be given back in order. If
+*the bitmap can't be allocated an error message is printed.
+*
+*Input: 
+*	a: job file
+*	b: number of the job
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int jobFileReturn(struct jobFile *jf, size_t job) {
+
+	if (job < jf->next) {
+		for (size_t j = job + 1; j < jf->next; j++) {
+			if (jobFileTake(jf, j) == -1) return -1;
+		}
+		jf->next = job;
+	}
+	if (job < jf->takenCap) jf->taken[job >> 3] &= ~(1 << (job & 7));
+	return 0;
+}
+
+/*This function checks if a job after the cursor is taken out of turn.
+*
+*Input: 
+*	a: job file
+*	b: number of the job
+*
+*Return: 
+*1 if it is, 0 if not
+*/
+int jobFileTaken(struct jobFile *jf, size_t job) {
+
+	return job < jf->takenCap && (jf->taken[job >> 3] & (1 << (job & 7)));
+}
+
+/*This function opens the state file of a job file, and reads the saved cursor from it if
+*it is not broken and it was saved for this version of the job file, or the job file
+*still has the bytes around the saved record, so it was only appended to since.
+*Otherwise the cursor is left at the first job.
+*
+*Input: 
+*	a: job file
+*	b: name of the job file
+*	c: where the saved state is stored
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int loadState(struct jobFile *jf, char *name, struct jobState *st) {
+
+	char *path = sidecarName(name, STATESUFFIX);
+	if (path == NULL) return -1;
+	jf->stateFd = open(path, O_RDWR | O_CREAT, 0644);
+	free(path);
+	if (jf->stateFd == -1) {
+		perror("open()");
+		return -1;
+	}
+
+	struct jobState saved;
+	if (pread(jf->stateFd, &saved, sizeof(saved), 0) != sizeof(saved)) return 0;
+	if (memcmp(saved.magic, STATEMAGIC, sizeof(saved.magic)) != 0 || 
+			saved.checksum != crc32(0, (Bytef *) &saved, offsetof(struct jobState, checksum)) ||
+			saved.fileSize > jf->mapLen || saved.offset > saved.fileSize ||
+			((saved.fileSize != jf->mapLen || saved.fileTime != jf->fileTime) && 
+			(saved.around == 0 || saved.around != aroundChecksum(jf, saved.offset, saved.fileSize)))) {
+		printf("%s%s doesn't match the job file, starting from the first job\n", name, STATESUFFIX);
+		return 0;
+	}
+	*st = saved;
+	return 0;
+}
+
+/*This function saves the cursor in the state file, if it moved or the job file grew since
+*the last time, and waits until it is on disk. It is meant to be called now and then and
+*not for every job, so that the disk isn't synced all the time. A job is saved together
+*with the offset of its record, so the index isn't needed to resume, and a checksum of 
+*the bytes around it, so that a job file that was changed in front of it is noticed.
+*
+*Input: 
+*	a: job file
+*	b: the first job that isn't done
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int jobFileCheckpoint(struct jobFile *jf, size_t job) {
+
+	if (jf->stateFd == -1 || jf->shrunk || job < jf->firstJob) return 0;
+	if (job == jf->savedJob && jf->mapLen == jf->savedSize) return 0;
+
+	struct jobState st;
+	memset(&st, 0, sizeof(st));
+	memcpy(st.magic, STATEMAGIC, sizeof(st.magic));
+	st.fileSize = jf->mapLen;
+	st.fileTime = jf->fileTime;
+	st.job = job;
+	st.offset = jf->offsets[job - jf->firstJob];
+	st.checksum = crc32(0, (Bytef *) &st, offsetof(struct jobState, checksum));
+	st.around = aroundChecksum(jf, st.offset, st.fileSize);
+	if (jf->shrunk) return 0; //It got smaller while the bytes were read
+
+	if (pwrite(jf->stateFd, &st, sizeof(st), 0) != sizeof(st) || fdatasync(jf->stateFd) == -1) {
+		perror("checkpoint");
+		return -1;
+	}
+	jf->savedJob = job;
+	jf->savedSize = jf->mapLen;
+	return 0;
+}
+
+/*This function computes the crc32 of the STATEWINDOW bytes on each side of an offset in
+*the job file, or fewer where the start or the given size of the file is closer. 
+*
+*Input: 
+*	a: job file, mapped at least up to the size
+*	b: offset
+*	c: size of the file to stop at
+*
+*Return: 
+*the checksum
+*/
+uint32_t aroundChecksum(struct jobFile *jf, uint64_t offset, uint64_t fileSize) {
+
+	uint64_t from = offset > STATEWINDOW ? offset - STATEWINDOW : 0;
+	uint64_t to = fileSize - offset > STATEWINDOW ? offset + STATEWINDOW : fileSize;
+	if (jf->map == NULL) return crc32(0, Z_NULL, 0);
+	return crc32(0, (Bytef *) jf->map + from, to - from);
+}
+
+/*This function makes the name of a file that belongs to a job file.
+*
+*Input: 
+*	a: name of the job file
+*	b: suffix of the other file
+*
+*Return: 
+*the name, wich has to be freed, NULL for error
+*/
+char * sidecarName(char *name, char *suffix) {
+
+	char *path = malloc(strlen(name) + strlen(suffix) + 1);
+	if (path == NULL) {
+		perror("malloc()");
+		return NULL;
+	}
+	strcpy(path, name);
+	strcat(path, suffix);
+	return path;
+}
+
+/*This function maps the sidecar index of the job file and takes the offsets, type 
+*counts and checksums from it. The sidecar is only used if it has the right magic and
+*size and was made from a job file of the same size and modification time.
+*
+*Input: 
+*	a: job file
+*	b: name of the job file
+*
+*Return: 
+*0 if the sidecar is used, 1 if there is none or it doesn't match, -1 for error
+*/
+int loadIndex(struct jobFile *jf, char *name) {
+
+	char *idx = sidecarName(name, INDEXSUFFIX);
+	if (idx == NULL) return -1;
+	int fd = open(idx, O_RDONLY);
+	free(idx);
+	if (fd == -1) return 1;
+
+	struct stat st;
+	struct jobIndexHeader *h;
+	if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(struct jobIndexHeader)) {
+		close(fd);
+		return 1;
+	}
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap()");
+		return -1;
+	}
+	h = (struct jobIndexHeader *) map;
+
+	uint64_t blocks = h->blockJobs ? (h->jobCount + h->blockJobs - 1) / h->blockJobs : 0;
+	if (memcmp(h->magic, INDEXMAGIC, sizeof(h->magic)) != 0 || h->fileSize != jf->mapLen ||
+			h->fileTime != jf->fileTime || h->blockJobs == 0 || h->jobCount > jf->mapLen / 3 ||
+			(size_t) st.st_size != sizeof(struct jobIndexHeader) + (h->jobCount + 1) * 8 + blocks * 4 ||
+			!offsetsValid((uint64_t *) (h + 1), h->jobCount, jf->mapLen)) {
+		printf("%s%s doesn't match the job file, it is indexed again\n", name, INDEXSUFFIX);
+		munmap(map, st.st_size);
+		return 1;
+	}
+
+	jf->indexMap = map;
+	jf->indexLen = st.st_size;
+	jf->offsets = (uint64_t *) (map + sizeof(struct jobIndexHeader));
+	jf->checksums = (uint32_t *) (jf->offsets + h->jobCount + 1);
+	jf->jobCount = h->jobCount;
+	jf->blockJobs = h->blockJobs;
+	memcpy(jf->typeCounts, h->typeCounts, sizeof(jf->typeCounts));
+	return 0;
+}
+
+/*This function checks the offsets of a sidecar index: the first record starts the file,
+*every record is at least a header and one byte of text and at most a header and 255
+*bytes, and the last one ends inside the file.
+*
+*Input: 
+*	a: offsets
+*	b: number of jobs, there is one more offset
+*	c: size of the job file
+*
+*Return: 
+*1 if they are valid, 0 if not
+*/
+int offsetsValid(uint64_t *offsets, size_t jobCount, size_t mapLen) {
+
+	if (offsets[0] != 0 || offsets[jobCount] > mapLen) return 0;
+	for (size_t i = 0; i < jobCount; i++) {
+		uint64_t length = offsets[i+1] - offsets[i];
+		if (offsets[i+1] < offsets[i] || length < 3 || length > 257) return 0;
+	}
+	return 1;
+}
+
+/*This function prints the number of jobs of every type in a job file, that are indexed,
+*and ends the line.
+*
+*Input: 
+*	a: job file
+*
+*Return: none
+*/
+void jobFilePrintTypes(struct jobFile *jf) {
+
+	for (int t = 0; t < 256; t++) {
+		if (jf->typeCounts[t] > 0) printf(" %c=%llu", t, (unsigned long long) jf->typeCounts[t]);
+	}
+	printf("\n");
+}
+
+/*This function writes the index of a job file that was walked to its sidecar. It is
+*written to a temporary file first and renamed, so a reader never sees half of it.
+*
+*Input: 
+*	a: job file
+*	b: name of the job file
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int jobFileWriteIndex(struct jobFile *jf, char *name) {
+
+	struct jobIndexHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, INDEXMAGIC, sizeof(h.magic));
+	h.fileSize = jf->mapLen;
+	h.fileTime = jf->fileTime;
+	h.jobCount = jf->jobCount;
+	h.blockJobs = INDEXBLOCK;
+	memcpy(h.typeCounts, jf->typeCounts, sizeof(h.typeCounts));
+	jf->blockJobs = INDEXBLOCK;
+
+	char *idx = sidecarName(name, INDEXSUFFIX);
+	if (idx == NULL) return -1;
+	char tmp[strlen(idx) + 5];
+	sprintf(tmp, "%s.tmp", idx);
+
+	FILE *f = fopen(tmp, "wb");
+	if (f == NULL) {
+		perror("fopen()");
+		free(idx);
+		return -1;
+	}
+	int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+	ok = ok && fwrite(jf->offsets, sizeof(uint64_t), jf->jobCount + 1, f) == jf->jobCount + 1;
+	for (size_t b = 0; ok && b * INDEXBLOCK < jf->jobCount; b++) {
+		uint32_t sum = blockChecksum(jf, b);
+		ok = fwrite(&sum, sizeof(sum), 1, f) == 1;
+	}
+	if (fclose(f) != 0) ok = 0;
+	if (!ok || rename(tmp, idx) == -1) {
+		perror("write index");
+		unlink(tmp);
+		free(idx);
+		return -1;
+	}
+	free(idx);
+	return 0;
+}
+
+/*This function computes the crc32 of the records of one block of jobs.
+*
+*Input: 
+*	a: job file
+*	b: number of the block
+*
+*Return: 
+*the checksum
+*/
+uint32_t blockChecksum(struct jobFile *jf, size_t block) {
+
+	size_t first = block * jf->blockJobs, last = first + jf->blockJobs;
+	if (last > jf->jobCount) last = jf->jobCount;
+	uLong sum = crc32(0, Z_NULL, 0);
+	return crc32(sum, (Bytef *) jf->map + jf->offsets[first], jf->offsets[last] - jf->offsets[first]);
+}
+
+/*This function checks a job file against the sidecar index it was opened with. Every
+*offset has to point at a record that ends where the next one starts, and every block
+*has to have the checksum in the sidecar.
+*
+*Input: 
+*	a: job file
+*
+*Return: 
+*the number of bad blocks, -1 if the file wasn't opened with a sidecar
+*/
+long jobFileVerify(struct jobFile *jf) {
+
+	if (jf->indexMap == NULL) return -1;
+
+	long bad = 0;
+	for (size_t b = 0; b * jf->blockJobs < jf->jobCount; b++) {
+
+		size_t first = b * jf->blockJobs, last = first + jf->blockJobs;
+		if (last > jf->jobCount) last = jf->jobCount;
+		int ok = jf->offsets[last] <= jf->mapLen;
+		for (size_t i = first; ok && i < last; i++) {
+			uint64_t o = jf->offsets[i];
+			ok = o + 2 <= jf->offsets[i+1] && jf->offsets[i+1] <= jf->offsets[last] && (unsigned char) jf->map[o+1] != 0 &&
+				o + 2 + (unsigned char) jf->map[o+1] == jf->offsets[i+1];
+		}
+		if (!ok || blockChecksum(jf, b) != jf->checksums[b]) {
+			printf("Block %zu (jobs %zu to %zu) doesn't match the index\n", b, first, last - 1);
+			bad++;
+		}
+	}
+	return bad;
+}
+
+/*This function starts the index at the record of the given job, and walks the headers
+*of the mapped file from there by walkRecords.
+*
+*Input: 
+*	a: job file
+*	b: job to start at
+*	c: offset of its record
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int buildIndex(struct jobFile *jf, size_t job, size_t pos) {
+
+	jf->firstJob = jf->jobCount = job;
+	jf->offsetsCap = 1024;
+	if ((jf->offsets = malloc(jf->offsetsCap * sizeof(uint64_t))) == NULL) {
+		perror("malloc()");
+		return -1;
+	}
+	jf->offsets[0] = pos;
+	return walkRecords(jf);
+}
+
+/*This function walks the headers of the mapped file from where the last indexed record
+*ends, and stores the offset of every complete record after it, plus the offset where 
+*the last one ends. It stops at a record with text length 0 or one that is cut off by
+*the end of the mapping.
+*
+*Input: 
+*	a: job file, with heap offsets
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int walkRecords(struct jobFile *jf) {
+
+	size_t pos = jf->offsets[jf->jobCount - jf->firstJob];
+	for (;;) {
+
+		if (jf->mapLen - pos < 2) break;
+		size_t textLength = (unsigned char) jf->map[pos+1];
+		if (textLength == 0 || jf->mapLen - pos - 2 < textLength) break;
+
+		if (jf->jobCount - jf->firstJob + 2 > jf->offsetsCap) {
+			uint64_t *o = realloc(jf->offsets, 2 * jf->offsetsCap * sizeof(uint64_t));
+			if (o == NULL) {
+				perror("realloc()");
+				return -1;
+			}
+			jf->offsets = o;
+			jf->offsetsCap *= 2;
+		}
+		jf->typeCounts[(unsigned char) jf->map[pos]]++;
+		pos += textLength + 2;
+		jf->jobCount++;
+		jf->offsets[jf->jobCount - jf->firstJob] = pos;
+	}
+	return 0;
+}
+
+/*This function maps the part of the job file that was appended since it was mapped, and
+*indexes the complete records in it. The mapping may move. If the cursor stopped at the 
+*end of the jobs it now stops at the new end, a cursor that only serves a part of the 
+*jobs keeps its part. A file that got smaller is marked as shrunk instead, and its 
+*cursor stops where it is, so no more jobs are taken from it. If any of it fails an 
+*error message is printed.
+*
+*Input: 
+*	a: job file
+*
+*Return: 
+*the number of new jobs, -1 for error
+*/
+int jobFileGrow(struct jobFile *jf) {
+
+	struct stat st;
+	if (fstat(jf->fd, &st) == -1) {
+		perror("fstat()");
+		return -1;
+	}
+	if (jf->shrunk) return 0;
+	if ((size_t) st.st_size < jf->mapLen) {
+		printf("%s got smaller, no more jobs are taken from it\n", jf->name);
+		jf->shrunk = 1;
+		jf->stop = jf->next;
+		return 0;
+	}
+	if ((size_t) st.st_size == jf->mapLen) return 0;
+
+	char *map;
+	if (jf->map == NULL) map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, jf->fd, 0);
+	else map = mremap(jf->map, jf->mapLen, st.st_size, MREMAP_MAYMOVE);
+	if (map == MAP_FAILED) {
+		perror("mremap()");
+		return -1;
+	}
+	jf->map = map;
+	jf->mapLen = st.st_size;
+	jf->fileTime = (uint64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	madvise(jf->map, jf->mapLen, MADV_SEQUENTIAL);
+
+	size_t before = jf->jobCount;
+	if (jf->indexMap != NULL && copyIndex(jf) == -1) return -1;
+	if (walkRecords(jf) == -1) return -1;
+	if (jf->stop == before) jf->stop = jf->jobCount;
+	return jf->jobCount - before;
+}
+
+/*This function copies the offsets from the sidecar index to the heap, with room to grow,
+*and unmaps the sidecar. Its checksums don't cover the new jobs, so they are dropped.
+*
+*Input: 
+*	a: job file
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int copyIndex(struct jobFile *jf) {
+
+	size_t count = jf->jobCount - jf->firstJob + 1;
+	size_t cap = 1024;
+	while (cap < 2 * count) cap *= 2;
+	uint64_t *o = malloc(cap * sizeof(uint64_t));
+	if (o == NULL) {
+		perror("malloc()");
+		return -1;
+	}
+	memcpy(o, jf->offsets, count * sizeof(uint64_t));
+	munmap(jf->indexMap, jf->indexLen);
+	jf->indexMap = NULL;
+	jf->checksums = NULL;
+	jf->offsets = o;
+	jf->offsetsCap = cap;
+	return 0;
+}
+
+/*This function unmaps and closes the job file and frees or unmaps its index. A shared 
+*job file leaves them to the file it is shared from.
+*
+*Input: 
+*	a: job file
+*
+*Return: none
+*/
+void jobFileClose(struct jobFile *jf) {
+
+	if (jf->shared) {
+		jf->map = jf->indexMap = NULL;
+		jf->offsets = NULL;
+		jf->fd = -1;
+	}
+	if (jf->map != NULL) munmap(jf->map, jf->mapLen);
+	if (jf->fd != -1) close(jf->fd);
+	if (jf->stateFd != -1) close(jf->stateFd);
+	if (jf->indexMap != NULL) munmap(jf->indexMap, jf->indexLen);
+	else free(jf->offsets);
+	free(jf->name);
+	free(jf->taken);
+	jf->name = NULL;
+	jf->taken = NULL;
+	jf->takenCap = 0;
+	jf->map = jf->indexMap = NULL;
+	jf->offsets = NULL;
+	jf->fd = jf->stateFd = -1;
+}
+
+/*This function finds a record in the mapping.
+*
+*Input: 
+*	a: job file
+*	b: number of the job
+*	c: where the length of the whole record is stored
+*
+*Return: 
+*pointer to the record in the mapping
+*/
+char * jobFileRecord(struct jobFile *jf, size_t job, size_t *length) {
+
+	uint64_t *o = jf->offsets + (job - jf->firstJob);
+	*length = o[1] - o[0];
+	return jf->map + o[0];
+}
+
+/*This function tells if a pointer points into the mapping of the job file, wich means
+*that the bytes it points to can also be read from the file itself at the same offset.
+*
+*Input: 
+*	a: job file, or NULL
+*	b: pointer
+*
+*Return: 
+*1 if it does, 0 if not
+*/
+int jobFileContains(struct jobFile *jf, void *p) {
+
+	char *c = p;
+	return jf != NULL && jf->map != NULL && c >= jf->map && c < jf->map + jf->mapLen;
+}
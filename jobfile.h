@@ -0,0 +1,89 @@
+/*H**********************************************************************
+* FILENAME:	jobfile.h
+*
+* NOTES:	The job file as the server sees it: a read-only memory 
+*		mapping of the file and an index with the offset of every 
+*		[type][length][text] record in it. The index is either built
+*		by walking the file or loaded from the sidecar file that
+*		jobindex writes next to it. A file that grows can be mapped
+*		and indexed further while it is served.
+*
+* AUTHOR: 	15119
+*
+*H*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define INDEXMAGIC "JOBIDX01"
+#define INDEXSUFFIX ".idx"
+#define INDEXBLOCK 4096		//Jobs covered by one checksum
+#define STATEMAGIC "JOBSTAT1"
+#define STATESUFFIX ".state"
+#define STATEWINDOW 4096	//Bytes on each side of the saved record covered by its checksum
+#define JOBINDEX 1		//jobFileOpen flags: use the sidecar index
+#define JOBRESUME 2		//and start where the state file says
+
+/*The sidecar index starts with this header, followed by jobCount+1 offsets and one
+*crc32 of the records of every block of blockJobs jobs. It is in host byte order.*/
+struct jobIndexHeader {
+	char magic[8];
+	uint64_t fileSize;	//Size and modification time (ns) of the job file
+	uint64_t fileTime;
+	uint64_t jobCount;
+	uint64_t blockJobs;
+	uint64_t typeCounts[256];
+};
+
+/*The state file has the job the cursor was at when the server last checkpointed.*/
+struct jobState {
+	char magic[8];
+	uint64_t fileSize;	//Size and modification time (ns) of the job file then
+	uint64_t fileTime;
+	uint64_t job;
+	uint64_t offset;	//Where the record of that job starts
+	uint32_t checksum;	//crc32 of everything before it
+	uint32_t around;	//crc32 of the bytes of the job file around the record, 0 if not saved
+};
+
+struct jobFile {
+	char *name;
+	int fd;
+	char *map;		//The whole file, NULL if it is empty
+	size_t mapLen;
+	uint64_t fileTime;
+	uint64_t *offsets;	//Offset of every record from firstJob on, and one past the last
+	size_t offsetsCap;	//Offsets there is room for, when they aren't from the sidecar
+	size_t firstJob;	//Jobs before it are done and not indexed
+	size_t jobCount;
+	size_t next;		//The job cursor
+	uint64_t typeCounts[256];
+	char *indexMap;		//The sidecar index, if the offsets come from it
+	size_t indexLen;
+	uint32_t *checksums;
+	size_t blockJobs;
+	int stateFd;		//The state file, with JOBRESUME
+	size_t savedJob;
+	size_t savedSize;	//Size of the job file when the state was saved
+	size_t stop;		//The cursor stops here, jobCount unless the jobs are split
+	unsigned char *taken;	//Jobs after the cursor that are taken out of turn, NULL if none
+	size_t takenCap;	//Jobs the bitmap has room for
+	int watch;		//inotify watch on the file while it is followed, -1 if none
+	int shrunk;		//The file got smaller, so none of it is read any more
+	int shared;		//The mapping, descriptor and index belong to the file it is shared from
+};
+
+int jobFileOpen(struct jobFile *jf, char *name, int flags);
+void jobFileClose(struct jobFile *jf);
+char * jobFileRecord(struct jobFile *jf, size_t job, size_t *length);
+int jobFileContains(struct jobFile *jf, void *p);
+int jobFileWriteIndex(struct jobFile *jf, char *name);
+long jobFileVerify(struct jobFile *jf);
+int jobFileCheckpoint(struct jobFile *jf, size_t job);
+void jobFilePart(struct jobFile *jf, int part, int parts);
+int jobFileShare(struct jobFile *jf, struct jobFile *from);
+int jobFileTake(struct jobFile *jf, size_t job);
+int jobFileReturn(struct jobFile *jf, size_t job);
+int jobFileTaken(struct jobFile *jf, size_t job);
+int jobFileGrow(struct jobFile *jf);
+void jobFilePrintTypes(struct jobFile *jf);
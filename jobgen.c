@@ -0,0 +1,230 @@
+/*H**********************************************************************
+* FILENAME:		jobgen.c
+*
+* COMPILE:		Make
+*
+* RUN:			./jobgen [-n <jobs>] [-l <min>:<max>] [-d uniform | log]
+*			[-t <type>=<weight>,...] [-r] [-s <seed>] <filename>
+*
+* NOTES:
+*	JOBS:		Writes a synthetic job file of [type][length][text]
+*			records for benchmarks. The text of every job starts
+*			with "job <number>", so the jobs that arrive can be
+*			checked, and is filled up to its length with log-like
+*			text, or with random letters with -r, wich
+*			hardly compress.
+*
+*	SIZES:		The text lengths are between <min> and <max> (at most
+*			255, the records have an 8 bit length). With -d uniform
+*			every length is as likely, with -d log short texts are
+*			more common, like in a log.
+*
+*	TYPES:		The types are drawn by weight, for example O=3,E=1
+*			gives three jobs for stdout for every job for stderr.
+*
+*			The same seed always gives the same file.
+*
+*
+* AUTHOR: 		15119
+*
+*H*/
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAXTEXT 255
+#define MAXTYPES 16
+
+char types[MAXTYPES];
+int weights[MAXTYPES], typeCount, totalWeight;
+int minLength = 16, maxLength = 200, logSizes, randomText;
+long jobCount = 1000000;
+uint64_t seed = 1;
+
+int parseOptions(int argc, char *argv[]);
+int parseTypes(char *spec);
+uint64_t nextRandom();
+int textLength();
+void fillText(char *text, int length, long job);
+
+/*This is the main method wich reads the options and writes the jobs to the file,
+*through a large stdio buffer.
+*
+*Input:
+*	a: number of arguments
+*	b: arguments
+*
+*Return:
+*EXIT_SUCCESS, or EXIT_FAILURE for errors
+*/
+int main(int argc, char *argv[]) {
+
+	if (parseOptions(argc, argv) == -1 || argc - optind != 1) {
+		printf("Correct usage: ./jobgen [-n <jobs>] [-l <min>:<max>] [-d uniform | log] [-t <type>=<weight>,...] [-r] [-s <seed>] <filename>\n");
+		return EXIT_FAILURE;
+	}
+
+	FILE *f = fopen(argv[optind], "wb");
+	if (f == NULL) {
+		perror("fopen()");
+		return EXIT_FAILURE;
+	}
+	setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+	char record[2 + MAXTEXT];
+	long bytes = 0;
+	for (long job = 0; job < jobCount; job++) {
+
+		int pick = nextRandom() % totalWeight, t = 0;
+		while (pick >= weights[t]) pick -= weights[t++];
+
+		int length = textLength();
+		record[0] = types[t];
+		record[1] = (char) length;
+		fillText(record + 2, length, job);
+		if (fwrite(record, length + 2, 1, f) != 1) {
+			perror("fwrite()");
+			fclose(f);
+			return EXIT_FAILURE;
+		}
+		bytes += length + 2;
+	}
+	if (fclose(f) != 0) {
+		perror("fclose()");
+		return EXIT_FAILURE;
+	}
+	printf("%ld jobs, %ld bytes in %s\n", jobCount, bytes, argv[optind]);
+	return EXIT_SUCCESS;
+}
+
+/*This function reads the options. If an option is unknown or has an invalid value
+*-1 (error) is returned.
+*
+*Input:
+*	a: number of arguments
+*	b: arguments
+*
+*Return:
+*0 for success, -1 for error
+*/
+int parseOptions(int argc, char *argv[]) {
+
+	int opt;
+	char *typeSpec = "O=1,E=1";
+	while ((opt = getopt(argc, argv, "n:l:d:t:rs:")) != -1) {
+		if (opt == 'n') jobCount = atol(optarg);
+		else if (opt == 'l') {
+			if (sscanf(optarg, "%d:%d", &minLength, &maxLength) != 2) return -1;
+		}
+		else if (opt == 'd') {
+			if (strcmp(optarg, "log") == 0) logSizes = 1;
+			else if (strcmp(optarg, "uniform") != 0) return -1;
+		}
+		else if (opt == 't') typeSpec = optarg;
+		else if (opt == 'r') randomText = 1;
+		else if (opt == 's') seed = strtoull(optarg, NULL, 10) | 1;
+		else return -1;
+	}
+	if (jobCount < 0 || minLength < 1 || maxLength > MAXTEXT || minLength > maxLength) {
+		printf("The lengths have to be between 1 and %d\n", MAXTEXT);
+		return -1;
+	}
+	return parseTypes(typeSpec);
+}
+
+/*This function reads a list of types and weights like O=3,E=1.
+*
+*Input:
+*	a: the list
+*
+*Return:
+*0 for success, -1 for error
+*/
+int parseTypes(char *spec) {
+
+	char *copy = strdup(spec), *save = NULL;
+	if (copy == NULL) {
+		perror("strdup()");
+		return -1;
+	}
+	for (char *t = strtok_r(copy, ",", &save); t != NULL; t = strtok_r(NULL, ",", &save)) {
+		if (typeCount == MAXTYPES || strlen(t) < 3 || t[1] != '=' || atoi(t + 2) < 1) {
+			printf("Types are given as <type>=<weight>,...\n");
+			free(copy);
+			return -1;
+		}
+		types[typeCount] = t[0];
+		weights[typeCount] = atoi(t + 2);
+		totalWeight += weights[typeCount++];
+	}
+	free(copy);
+	return typeCount > 0 ? 0 : -1;
+}
+
+/*This function is a xorshift random generator, so that a seed gives the same file
+*everywhere.
+*
+*Input: none
+*
+*Return:
+*the next random number
+*/
+uint64_t nextRandom() {
+
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed;
+}
+
+/*This function draws the length of the next text.
+*
+*Input: none
+*
+*Return:
+*the length
+*/
+int textLength() {
+
+	if (!logSizes) return minLength + nextRandom() % (maxLength - minLength + 1);
+
+	double u = (nextRandom() >> 11) * (1.0 / 9007199254740992.0);
+	int length = (int) (minLength * pow((double) (maxLength + 1) / minLength, u));
+	return length > maxLength ? maxLength : length;
+}
+
+/*This function writes the text of a job. It starts with the number of the job and is
+*filled up with log-like words, or random characters with -r. If the number doesn't
+*fit, the text is only the start of it.
+*
+*Input:
+*	a: where the text is written
+*	b: length of the text
+*	c: number of the job
+*
+*Return: none
+*/
+void fillText(char *text, int length, long job) {
+
+	static const char *words[] = {"INFO", "request", "served", "from", "cache", "in", "ms", "user", "session", "ok"};
+	static const char chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+	char start[32];
+	int n = snprintf(start, sizeof(start), "job %ld ", job);
+	int pos = n < length ? n : length;
+	memcpy(text, start, pos);
+
+	while (pos < length) {
+		if (randomText) text[pos++] = chars[nextRandom() % (sizeof(chars) - 1)];
+		else {
+			const char *w = words[nextRandom() % (sizeof(words) / sizeof(words[0]))];
+			for (int i = 0; w[i] != '\0' && pos < length; i++) text[pos++] = w[i];
+			if (pos < length) text[pos++] = ' ';
+		}
+	}
+}
@@ -0,0 +1,77 @@
+/*H**********************************************************************
+* FILENAME:		jobindex.c
+*
+* COMPILE:		Make
+*
+* RUN:			./jobindex [-v] <filename>
+*
+* NOTES:
+*	INDEX:		Walks a job file once and writes its index to the sidecar
+*			<filename>.idx: a header with the size and modification
+*			time of the job file, the number of jobs and the number
+*			of jobs of every type, the offset of every record and a
+*			crc32 of every block of INDEXBLOCK jobs. The server maps
+*			the sidecar instead of walking the file when it starts.
+*			The sidecar has to be made again when the file changes,
+*			otherwise the server doesn't use it.
+*
+*	VERIFY:		With -v the job file is checked against its sidecar 
+*			instead, record by record and block by block, and the 
+*			blocks that don't match are printed.
+*
+*
+* AUTHOR: 		15119
+*
+*H*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "jobfile.h"
+
+/*This is the main method wich reads the options, opens the job file and either writes
+*its sidecar index or verifies the file against it.
+*
+*Input: 
+*	a: number of arguments
+*	b: arguments
+*
+*Return: 
+*EXIT_SUCCESS, or EXIT_FAILURE on errors and blocks that don't match
+*/
+int main(int argc, char *argv[]) {
+
+	int opt, verify = 0;
+	while ((opt = getopt(argc, argv, "v")) != -1) {
+		if (opt == 'v') verify = 1;
+		else return EXIT_FAILURE;
+	}
+	if (argc - optind != 1) {
+		printf("Correct usage: ./jobindex [-v] <filename>\n");
+		return EXIT_FAILURE;
+	}
+	char *name = argv[optind];
+
+	struct jobFile jf;
+	if (jobFileOpen(&jf, name, verify ? JOBINDEX : 0) == -1) return EXIT_FAILURE;
+	printf("%zu jobs in %s:", jf.jobCount, name);
+	jobFilePrintTypes(&jf);
+
+	int status = EXIT_SUCCESS;
+	if (verify) {
+		long bad = jobFileVerify(&jf);
+		if (bad == -1) printf("%s has no index that matches it\n", name);
+		else if (bad == 0) printf("%s matches its index\n", name);
+		if (bad != 0) status = EXIT_FAILURE;
+	}
+	else if (jobFileWriteIndex(&jf, name) == -1) status = EXIT_FAILURE;
+	else printf("Index written to %s%s\n", name, INDEXSUFFIX);
+
+	if (!verify && (size_t) jf.offsets[jf.jobCount] < jf.mapLen) {
+		printf("The last %zu bytes of %s are not jobs\n", jf.mapLen - (size_t) jf.offsets[jf.jobCount], name);
+	}
+	jobFileClose(&jf);
+	return status;
+}
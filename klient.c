@@ -3,7 +3,9 @@
 *
 * COMPILE:		Make
 *
-* RUN:			./klient <hostname> <port>
+* RUN:			./klient [-a | -j <jobs> | -R <first>:<count> | -B <offset>:<bytes>] [-1 | -c] 
+*			[-t [-n <workers>] [-o]] [-w <window>] [-f <prefix>] [-F idle | full | <ms>] [-A]
+*			[-T <types>] [-P <text> | -S <text>] <hostname> <port> | -l <socket>
 *
 * NOTES:
 *	ARGUMENTS: 	Host names are accepted as arguments and parsed to IP-
@@ -16,23 +18,127 @@
 *			to read. However, when the server reaches the end, klient 
 *			terminates.
 *
-*	PROTOCOL:	Initially sends two bytes to server seperatly. The first
-*			is a GETJOB message (char), and the second is the number 
+*	DRAIN:		With -a all the jobs on the server are executed, and with
+*			-j <jobs> that many, without asking the user anything.
+*			The batches start at MINBATCH jobs and double up to the
+*			largest batch, so the first jobs arrive at once, and the 
+*			last jobs are spread over the window. When it is done the
+*			number of jobs, the time and the throughput are printed.
+*			If the server can't be reached the klient exits instead 
+*			of waiting for the user.
+*
+*	RANGES:		With -R <first>:<count> the jobs with those numbers are
+*			executed, and with -B <offset>:<bytes> the jobs whose 
+*			records start in those bytes of the job file, and then 
+*			the klient exits like in the drain mode. The cursor of
+*			the server isn't used or moved, so klients can split a 
+*			file in ranges between them, and a range can be fetched 
+*			again after a failure.
+*
+*	LOCAL:		With -l <socket> the klient connects to the Unix socket
+*			of a server on the same host instead, and asks for the
+*			shared memory feature. The server then sends a ring in
+*			shared memory with its answer to the HELLO, and the 
+*			batches are taken from the ring with a memcpy instead of
+*			recv(). The klient only sleeps on an eventfd when the 
+*			ring is empty, and the requests still go on the socket.
+*
+*	PROTOCOL:	Right after connecting a HELLO is sent with the protocol 
+*			version and the wanted features, and the server answers 
+*			with the version and features it agrees to. In version 2
+*			a GETJOB message (char) is followed by the number of jobs
+*			as four bytes, and every job has a four byte textlength,
+*			so a batch is 4096 jobs instead of 255. Without -c the
+*			klient asks for the records feature as well, and then 
+*			gets jobs that follow each other in the job file as one
+*			RECORDS frame with the records as they are in the file,
+*			wich are taken out of it one by one.
+*
+*			With -1 the old version 1 is used without a HELLO. Then
+*			the GETJOB message is followed by one byte with the number 
 *			of jobs, wich i have set a max-limit to 255.
 *
+*	FILTER:		With -T <types> only the jobs of those types are sent,
+*			-T E for example. With -P <text> only the jobs whose 
+*			jobtext starts with the text, and with -S <text> only 
+*			those that contain it. The filter is sent to the server
+*			right after the HELLO, and the server skips the other
+*			jobs, wich are left for other klients.
+*
+*	COMPRESSION:	With -c the klient asks for compressed batches. The 
+*			server then sends pieces of a batch as 'Z' frames, wich
+*			are uncompressed into a buffer of their own before the
+*			jobs in them are executed. The server stops compressing
+*			by itself when the jobs don't compress.
+*
+*	PIPELINING:	A query for more than 255 jobs is split into several
+*			GETJOB requests. Up to <window> of them (default 4) are
+*			outstanding at the same time, so the server keeps sending
+*			while earlier batches are executed. A new request is only
+*			sent when a whole batch has been executed, wich keeps the
+*			amount of jobs in flight bounded.
+*
+*	THREADS:	With -t the jobs are executed by worker threads in the
+*			klient process instead of forked children. A job is not
+*			copied, the worker gets a pointer to the text in the 
+*			receive buffer through a lock-free ring. There are two
+*			receive buffers that take turns, and a buffer is only 
+*			filled again when the workers are done with every job
+*			in it.
+*
+*			-n sets the number of workers for every job type (default
+*			1). A worker that runs out of jobs steals from the others
+*			of its type. With -o the jobs of a type are executed in the
+*			order they arrive, by one worker of that type, so -o 
+*			can't be combined with -n.
+*
+*	QUEUES:		Without -t the parent never waits for a pipe. The jobs
+*			for a child are put in a queue of its own, and written
+*			to the pipe when epoll says there is room, so a slow 
+*			child doesn't hold up the other one. While the queue a
+*			job is for is full the queues are written and the socket
+*			is still read, into the free end of the receive buffer.
+*			The server is only held back when that is full as well.
+*			The queues are emptied before the user is asked again.
+*
+*	JOBTYPES:	What a job type does is found in a table with an entry
+*			for every possible type byte, with the function that 
+*			executes it and the child or worker type it goes to. A
+*			new type is added with registerJobType(), and a type
+*			without an entry is an error.
+*
+*	OUTPUT:		The texts are not printed one by one, every child or
+*			worker collects them in a large buffer that is written
+*			at once. With -f <prefix> every type is written to a file
+*			<prefix>.<type> instead of stdout and stderr. -F sets when
+*			a buffer is written before it is full: when the child or
+*			worker runs out of jobs (idle, the default), only at the
+*			end (full), or also when a text has waited <ms>. With -A 
+*			the buffers are written by a thread of their own. A child
+*			reads its pipe in large chunks as well.
+*
 *
 * AUTHOR: 		15119
 *
 *H*/
 
-#define _POSIX_SOURCE
+#define _GNU_SOURCE
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
+#include <poll.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
+#include <zlib.h>
 #include "communication.h"
+#include "shmring.h"
+#include "sinks.h"
+#include "workers.h"
 
 #define CHILDREN 2
 #define TERMINATECHILDREN ((char) 'Q')
@@ -43,28 +149,97 @@
 #define FINISHED 0
 #define READ 0
 #define WRITE 1
+#define MAXWINDOW 64
+#define MAXWORKERS 256
+#define MINBATCH 64
+#define PIPEQUEUESIZE (1024 * 1024)
+#define WAITSERVER -1
+#define WAITQUEUES -2
+
+struct jobRoute {
+	int (*execute)(char *frame, size_t length, int *release, int target);	//NULL for an unknown type
+	int target;		//Child or worker type the job goes to
+};
+
+/*Jobs for a child that aren't written to its pipe yet, as the child reads them*/
+struct pipeQueue {
+	char *data;		//PIPEQUEUESIZE bytes, NULL once the pipe is closed
+	size_t start, end;
+	int watched;		//The pipe is in parentEpoll
+};
 
 pid_t children[CHILDREN];
 int clientSocket, childNR, parent;
+int window = 4;
 int fd[CHILDREN][2];
+struct recvBuffer serverInput[2];
+int current, threads, ordered;
+int protocolVersion = PROTOCOLVERSION, batchSize = MAXJOBS;
+uint32_t features;
+int workersPerType = 1;
+int inUse[2];	//Jobs in each receive buffer that workers aren't done with
+struct recvBuffer unpacked[2];	//Jobs from compressed frames
+int unpackedCurrent, unpackedInUse[2];
+char *records;			//The next record of a RECORDS frame
+size_t recordsLeft;		//Bytes of it that aren't executed
+int *recordsRelease;
+size_t jobHeader;		//Header length of the job nextJob returned last
+z_stream zs;
 char *address;
 char *input;
-
+int drain, autoBatch = MINBATCH;
+long drainJobs = LONG_MAX, drained, drainedBytes;
+struct timespec drainStart;
+char jobTypes[CHILDREN] = {STDOUTCHILD1, STDERRCHILD2};
+char *outputPrefix;
+int outputPolicy = FLUSHIDLE, asyncOutput;
+char *localPath;
+struct sockaddr_un localAddr;
+struct shmLink serverLink;	//serverLink.h is NULL without shared memory
+struct jobRoute jobRoutes[256];	//By the job type
+char *filterTypes, *filterText;	//NULL for every type and every text
+int filterMode = FILTERTYPES;
+int rangeUnit = -1;		//RANGEJOBS or RANGEBYTES with -R or -B
+uint64_t rangeFirst, rangeCount;
+long rangeLeft;			//Jobs of the range that haven't come, -1 before the answer
+struct pipeQueue pipeQueues[CHILDREN];
+int parentEpoll = -1, socketWatched, serverClosed;
+
+int parseOptions(int argc, char *argv[]);
 int initializePipes();
 int initializeChildren();
 void closeUNPipes();
 void closeNPipes();
+int initializeQueues();
 int connectToServer();
 void serverConnectionHelp();
 char * hostToIP(char *address);
 int sendMessageToServer(char msg);
+int sayHello();
+int sendFilter();
 int jobQuery();
 int readLoop(int numJobs);
+int nextBatch(int numJobs);
+int drainJobsFromServer();
+int parseRange(char *arg, int unit);
+int fetchRange();
+void drainSummary();
 int askForJobs(int numJobs);
 int executeJob();
-int jobChooser(char jobType);
+char * nextJob(size_t *length, int **release);
+int unpack(char *frame, size_t length);
+int receiveMore();
+void registerJobTypes();
+void registerJobType(char type, int (*execute)(char *frame, size_t length, int *release, int target), int target);
+int consumerJob(char *frame, size_t length, int *release, int target);
+int quitJob(char *frame, size_t length, int *release, int target);
+int rangeJob(char *frame, size_t length, int *release, int target);
+int queueJob(int child, char *text, size_t length);
+int writeQueue(int child);
+int waitForEvents(int until, size_t need);
+int watchFd(int fd, int *watched, int on, uint32_t events);
 int childTask();
-void childPrint(char *msg);
+void childPrint(int child, char *msg, int length);
 void terminateChildren();
 int childStatus(pid_t c[]);
 
@@ -95,17 +270,44 @@ int main(int argc, char *argv[]) {
 
 	/*Initialize sighandler, variables, pipes and children*/
 	if (init_sig_handler() == -1) exit(EXIT_FAILURE);
-	if (checkArguments(argc, argv[1], argv[2]) == -1) exit(EXIT_FAILURE);
-	if (initializePipes() == -1) terminator(ERRORTERMINATE);
-	parent = initializeChildren();
-	if (parent == -1) terminator(ERRORTERMINATE);
-	closeUNPipes();
+	if (parseOptions(argc, argv) == -1) exit(EXIT_FAILURE);
+	int rest = argc - optind;
+	if (localPath == NULL) {
+		if (checkArguments(rest + 1, rest > 0 ? argv[optind] : NULL, rest > 1 ? argv[optind+1] : NULL) == -1) exit(EXIT_FAILURE);
+	} else if (rest != 0) {
+		printf("With -l no address and port are given\n");
+		exit(EXIT_FAILURE);
+	}
+	if (sinkOpen(outputPrefix, jobTypes, CHILDREN, outputPolicy, asyncOutput) == -1) exit(EXIT_FAILURE);
+	registerJobTypes();
+	if (threads) {
+		parent = 1;
+		if (startWorkers(CHILDREN, workersPerType, ordered, childPrint, sinkFlush) == -1) terminator(ERRORTERMINATE);
+	} else {
+		if (initializePipes() == -1) terminator(ERRORTERMINATE);
+		parent = initializeChildren();
+		if (parent == -1) terminator(ERRORTERMINATE);
+		closeUNPipes();
+		if (parent && initializeQueues() == -1) terminator(ERRORTERMINATE);
+	}
 
 	if (parent) { //Parent process	
 	
 		/*Connect to server*/
-		if ((clientSocket = createSocket(address, port)) == -1) terminator(ERRORTERMINATE);
-		serverConnectionHelp();
+		if (localPath != NULL) clientSocket = createLocalSocket(localPath, &localAddr);
+		else clientSocket = createSocket(address, port);
+		if (clientSocket == -1) terminator(ERRORTERMINATE);
+		if (drain) {
+			if (connectToServer() == -1) terminator(ERRORTERMINATE);
+			socketConnection = CONNECTED;
+		}
+		else serverConnectionHelp();
+		if (sayHello() == -1) terminator(ERRORTERMINATE);
+
+		if (drain) {
+			testValue = rangeUnit != -1 ? fetchRange() : drainJobsFromServer();
+			terminator(testValue == -1 ? ERRORTERMINATE : NORMALTERMINATE);
+		}
 
 		for (;;) {	
 
@@ -119,7 +321,9 @@ int main(int argc, char *argv[]) {
 
 	} else { //Child process
 
+		fcntl(fd[childNR][READ], F_SETFL, O_NONBLOCK);
 		while(childTask() == 0);
+		sinkClose();
 		close(fd[childNR][READ]);
 	}
 	return 0;
@@ -145,7 +349,7 @@ int main(int argc, char *argv[]) {
 int checkArguments(int argc, char *h, char *p) {
 
 	if (argc != 3) {
-		printf("Correct usage: ./klient <adress> <port>\n");
+		printf("Correct usage: ./klient [-a | -j <jobs>] [-1 | -c] [-t [-n <workers>] [-o]] [-w <window>] [-f <prefix>] [-F idle | full | <ms>] [-A] <adress> <port> | -l <socket>\n");
 		return -1;
 	}
 	
@@ -161,6 +365,114 @@ int checkArguments(int argc, char *h, char *p) {
 	return 0;
 }
 
+/*This function reads the options given before the address and port. 
+*-w sets how many GETJOB requests can be outstanding at the same time,
+*and -t executes the jobs in worker threads instead of children. -n sets
+*the number of workers for every job type, and -o keeps the jobs of a
+*type in order, wich takes one worker per type, so it can't be used with
+*-n. -1 makes the klient talk protocol version 1, and -c asks for 
+*compressed batches, wich needs version 2. -a drains all the jobs and -j
+*drains a number of jobs, without the query. -f writes the texts to files,
+*-F sets the flush policy and -A writes them in a thread of their own.
+*-l connects to the Unix socket of a local server, through shared memory.
+*If an option is unknown or has an invalid value a message is printed
+*and -1 (error) is returned.
+*
+*Input: 
+*	a: number of arguments
+*	b: arguments
+*
+*Return: 
+*0 for success, -1 for error
+*/
+int parseOptions(int argc, char *argv[]) {
+
+	int opt;
+	while ((opt = getopt(argc, argv, "aj:1ctn:ow:f:F:Al:T:P:S:R:B:")) != -1) {
+		if (opt == 'a') drain = 1;
+		else if (opt == 'j') {
+			drain = 1;
+			drainJobs = atol(optarg);
+			if (drainJobs < 1) {
+				printf("The number of jobs has to be at least 1\n");
+				return -1;
+			}
+		}
+		else if (opt == '1') protocolVersion = 1;
+		else if (opt == 'c') features |= FEATURECOMPRESS;
+		else if (opt == 't') threads = 1;
+		else if (opt == 'o') ordered = 1;
+		else if (opt == 'n') {
+			workersPerType = atoi(optarg);
+			if (workersPerType < 1 || workersPerType > MAXWORKERS) {
+				printf("The number of workers has to be between 1 and %d\n", MAXWORKERS);
+				return -1;
+			}
+		}
+		else if (opt == 'w') {
+			window = atoi(optarg);
+			if (window < 1 || window > MAXWINDOW) {
+				printf("The window has to be between 1 and %d\n", MAXWINDOW);
+				return -1;
+			}
+		}
+		else if (opt == 'f') outputPrefix = optarg;
+		else if (opt == 'F') {
+			if (strcmp(optarg, "idle") == 0) outputPolicy = FLUSHIDLE;
+			else if (strcmp(optarg, "full") == 0) outputPolicy = FLUSHFULL;
+			else if ((outputPolicy = atoi(optarg)) < 1) {
+				printf("The flush policy is idle, full or a number of ms\n");
+				return -1;
+			}
+		}
+		else if (opt == 'A') asyncOutput = 1;
+		else if (opt == 'l') {
+			localPath = optarg;
+			features |= FEATURESHM;
+		}
+		else if (opt == 'R' || opt == 'B') {
+			if (parseRange(optarg, opt == 'R' ? RANGEJOBS : RANGEBYTES) == -1) return -1;
+		}
+		else if (opt == 'T') filterTypes = optarg;
+		else if (opt == 'P' || opt == 'S') {
+			if (filterText != NULL || strlen(optarg) > MAXFILTERTEXT) {
+				printf("One text of at most %d bytes can be given with -P or -S\n", MAXFILTERTEXT);
+				return -1;
+			}
+			filterText = optarg;
+			filterMode = opt == 'P' ? FILTERPREFIX : FILTERCONTAINS;
+		}
+		else return -1;
+	}
+	if (filterTypes != NULL || filterText != NULL) features |= FEATUREFILTER;
+	if ((workersPerType > 1 || ordered) && !threads) {
+		printf("-n and -o are only used with -t\n");
+		return -1;
+	}
+	if (workersPerType > 1 && ordered) {
+		printf("-n and -o can't be combined, -o executes the jobs of a type in one worker\n");
+		return -1;
+	}
+	if ((features & FEATURECOMPRESS) && protocolVersion == 1) {
+		printf("-c needs protocol version 2\n");
+		return -1;
+	}
+	if (localPath != NULL && protocolVersion == 1) {
+		printf("-l needs protocol version 2\n");
+		return -1;
+	}
+	if ((features & FEATUREFILTER) && protocolVersion == 1) {
+		printf("-T, -P and -S need protocol version 2\n");
+		return -1;
+	}
+	if (rangeUnit != -1 && (protocolVersion == 1 || (features & FEATUREFILTER))) {
+		printf("-R and -B need protocol version 2, and can't be used with a filter\n");
+		return -1;
+	}
+	if (protocolVersion == 2 && !(features & FEATURECOMPRESS)) features |= FEATURERECORDS;
+	return 0;
+}
+
 /*This function initializes CHILDREN number of pipes, and prints an
 *error message if the initialization fails.
 *
@@ -232,10 +544,43 @@ void closeUNPipes() {
 *Return: none
 */
 void closeNPipes() {
-	if (parent) for (int i = 0; i < CHILDREN; i ++) close(fd[i][WRITE]);
+	if (parent) {
+		for (int i = 0; i < CHILDREN; i ++) {
+			close(fd[i][WRITE]);
+			free(pipeQueues[i].data);
+			pipeQueues[i].data = NULL;
+		}
+	}
 	else close(fd[childNR][READ]);
 }
 
+/*This function sets up the queues of the children and the epoll instance the parent
+*waits on, and makes the pipes non-blocking. If it fails an error message is printed.
+*
+*Input: none
+*
+*Return: 
+*0 for success, -1 for error
+*/
+int initializeQueues() {
+
+	if ((parentEpoll = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		perror("epoll_create1()");
+		return -1;
+	}
+	for (int i = 0; i < CHILDREN; i++) {
+		if ((pipeQueues[i].data = malloc(PIPEQUEUESIZE)) == NULL) {
+			perror("malloc()");
+			return -1;
+		}
+		if (fcntl(fd[i][WRITE], F_SETFL, O_NONBLOCK) == -1) {
+			perror("fcntl()");
+			return -1;
+		}
+	}
+	return 0;
+}
+
 /*This function connects the socket to the server.
 *
 *Input: 
@@ -245,7 +590,8 @@ void closeNPipes() {
 */
 int connectToServer() {
 
-	testValue = connect(clientSocket, (struct sockaddr *) &serverAddr, addr_size);
+	if (localPath != NULL) testValue = connect(clientSocket, (struct sockaddr *) &localAddr, sizeof(localAddr));
+	else testValue = connect(clientSocket, (struct sockaddr *) &serverAddr, addr_size);
 	
 	if (testValue == -1) perror("connect()");
 	else printf("\n---Successfully connected to the server!---\n\n");
@@ -314,12 +660,91 @@ int sendMessageToServer(char msg) {
 	return writeToFileDescriptor(clientSocket, buffer, 1);
 }
 
+/*This function agrees on a protocol version with the server. A HELLO message with the
+*version and features of this klient is sent, and the answer from the server has the
+*version and features that are used from now on. With version 1 nothing is sent. If
+*the server agrees to compression the stream that uncompresses is set up. On the Unix
+*socket the answer comes with the shared memory ring of the klient.
+*
+*Input: none
+*
+*Return: 
+*0 for success, -1 for error
+*/
+int sayHello() {
+
+	if (protocolVersion == 2) {
+
+		char hello[HELLOLENGTH];
+		hello[0] = HELLO;
+		hello[1] = PROTOCOLVERSION;
+		putLength(hello + 2, features);
+		if (writeToFileDescriptor(clientSocket, hello, sizeof(hello)) == -1) return -1;
+
+		if (localPath != NULL) {
+			if (shmReceiveHello(clientSocket, hello, sizeof(hello), &serverLink) == -1) return -1;
+		}
+		else if (readFromFileDescriptor(clientSocket, hello, sizeof(hello)) == -1) return -1;
+		if (hello[0] != HELLO || hello[1] < 1 || hello[1] > PROTOCOLVERSION) {
+			printf("The server doesn't understand protocol version %d\n", PROTOCOLVERSION);
+			return -1;
+		}
+		protocolVersion = hello[1];
+		features = getLength(hello + 2);
+		if (!(features & FEATURESHM) && serverLink.h != NULL) shmClose(&serverLink);
+		if ((features & FEATURESHM) && serverLink.h == NULL) {
+			printf("The server didn't send its shared memory\n");
+			return -1;
+		}
+		if ((features & FEATURECOMPRESS) && inflateInit(&zs) != Z_OK) {
+			printf("inflateInit(): %s\n", zs.msg ? zs.msg : "failed");
+			return -1;
+		}
+		if ((filterTypes != NULL || filterText != NULL) && sendFilter() == -1) return -1;
+	}
+
+	if (protocolVersion == 2) batchSize = MAXJOBSV2;
+	for (int i = 0; i < 2; i++) {
+		serverInput[i].headerLen = (protocolVersion == 2) ? V2HEADER : V1HEADER;
+		unpacked[i].headerLen = V2HEADER;
+	}
+	return 0;
+}
+
+/*This function sends the filter of the klient to the server, wich is a bit for every job
+*type that is wanted, the mode and the text.
+*
+*Input: none
+*
+*Return: 
+*0 for success, -1 for error
+*/
+int sendFilter() {
+
+	if (!(features & FEATUREFILTER)) {
+		printf("The server can't filter jobs\n");
+		return -1;
+	}
+	size_t textLen = filterText != NULL ? strlen(filterText) : 0;
+	char msg[V2HEADER + FILTERBODY + MAXFILTERTEXT];
+	unsigned char *types = (unsigned char *) msg + V2HEADER;
+
+	msg[0] = FILTER;
+	putLength(msg + 1, FILTERBODY + textLen);
+	memset(types, filterTypes == NULL ? 0xff : 0, 32);
+	for (char *t = filterTypes; t != NULL && *t != '\0'; t++) types[(unsigned char) *t >> 3] |= 1 << (*t & 7);
+	msg[V2HEADER + 32] = filterMode;
+	if (textLen > 0) memcpy(msg + V2HEADER + FILTERBODY, filterText, textLen);
+	return writeToFileDescriptor(clientSocket, msg, V2HEADER + FILTERBODY + textLen);
+}
+
 /*This function prompts the user with a query asking what the user wants to do out of 4
 *alternatives. A string will be read from the user and then compared to the options. If
 *an invalid option are chosen 0 is returned and a message is printed. If alternative 2
 *is chosen, an additional query is presented where the user have to name the amount of
-*jobs he/she wants to recieve from the server. If the user chooses alternative 3 then
-*the maximum ammount of jobs that can be printed out wich i set at 255 is returned. 
+*jobs he/she wants to recieve from the server, wich is not limited since readLoop splits
+*it into batches. If the user chooses alternative 3 then the maximum ammount of jobs in 
+*one batch wich i set at 255 (4096 in version 2) is returned. 
 *
 *Input: none
 *
@@ -331,7 +756,7 @@ int jobQuery() {
 	int value = 0;
 	input = malloc(sizeof(char)*8);
 	
-	printf("1) Get 1 job from server\n2) Get X job(s) from server\n3) Get all jobs (%d) from server\n0) Exit\n> ", MAXJOBS);
+	printf("1) Get 1 job from server\n2) Get X job(s) from server\n3) Get all jobs (%d) from server\n0) Exit\n> ", batchSize);
 	scanf(" %s", input);
 	getchar( );
 
@@ -342,10 +767,9 @@ int jobQuery() {
 		scanf(" %s", input);
 		getchar( );
 		value = atoi(input);
-		if (value > MAXJOBS) value = MAXJOBS;
-		else if (value < 0) value = 0;
+		if (value < 0) value = 0;
 	} 
-	else if (strcmp(input, "3") == 0) value = MAXJOBS;
+	else if (strcmp(input, "3") == 0) value = batchSize;
 	else if (strcmp(input, "0") != 0) printf("%s, is not an alternative.\n", input);
 
 	free(input);
@@ -354,27 +778,159 @@ int jobQuery() {
 	return value;
 }
 
-/*This function calls askForJobs wich sends a message to the server asking for numJobs jobs.
-*It then enters a for loop wich is ment to call executeJob numJobs times, but will be broken
-*it executeJob returns -1 (error). The returnValue is then returned, and it will be 0 if 
-*the ammount of jobs the user wanted actually got executed, and -1 if not.
+/*This function executes the jobs of the drain mode, all of them or drainJobs of them, by
+*calling readLoop with as many jobs at a time as it takes.
+*
+*Input: none
+*
+*Return: 
+*0 for success, 1 for end of file, -1 for error
+*/
+int drainJobsFromServer() {
+
+	clock_gettime(CLOCK_MONOTONIC, &drainStart);
+	testValue = 0;
+	for (long left = drainJobs; left > 0 && testValue == 0; ) {
+		int numJobs = left > INT_MAX ? INT_MAX : (int) left;
+		testValue = readLoop(numJobs);
+		left -= numJobs;
+	}
+	return testValue;
+}
+
+/*This function reads the range of -R or -B, wich is <first>:<count>, and turns on the 
+*drain mode.
+*
+*Input: 
+*	a: the range
+*	b: RANGEJOBS or RANGEBYTES
+*
+*Return: 
+*0 for success, -1 for error
+*/
+int parseRange(char *arg, int unit) {
+
+	char *end;
+	errno = 0;
+	rangeFirst = strtoull(arg, &end, 10);
+	if (*end == ':') rangeCount = strtoull(end + 1, &end, 10);
+	if (errno != 0 || *end != '\0' || rangeCount == 0 || arg[0] == '-' || strchr(arg, ':') == NULL) {
+		printf("A range is <first>:<count>, with a count of at least 1\n");
+		return -1;
+	}
+	rangeUnit = unit;
+	features |= FEATURERANGE;
+	drain = 1;
+	return 0;
+}
+
+/*This function executes a range of jobs with a GETRANGE request. The server first 
+*answers with the number of jobs in the range, wich rangeJob stores, and then sends 
+*them. When they are all executed the children or workers are given the rest of them.
+*
+*Input: none
+*
+*Return: 
+*0 for success, 1 for end of file, -1 for error
+*/
+int fetchRange() {
+
+	if (!(features & FEATURERANGE)) {
+		printf("The server can't send ranges\n");
+		return -1;
+	}
+	char msg[RANGELENGTH];
+	msg[0] = GETRANGE;
+	msg[1] = rangeUnit;
+	putLength(msg + 2, rangeFirst >> 32);
+	putLength(msg + 6, (uint32_t) rangeFirst);
+	putLength(msg + 10, rangeCount >> 32);
+	putLength(msg + 14, (uint32_t) rangeCount);
+
+	clock_gettime(CLOCK_MONOTONIC, &drainStart);
+	if (writeToFileDescriptor(clientSocket, msg, sizeof(msg)) == -1) return -1;
+	rangeLeft = -1;
+	testValue = executeJob();
+	if (testValue == 0 && rangeLeft < 0) {
+		printf("ERROR: The server didn't answer the range\n");
+		return -1;
+	}
+	for (; rangeLeft > 0 && testValue == 0; rangeLeft--) testValue = executeJob();
+	if (testValue != 0) return testValue;
+
+	if (threads) wakeWorkers();
+	else if (waitForEvents(WAITQUEUES, 0) == -1) return -1;
+	return 0;
+}
+
+/*This function chooses the size of the next batch. Normally that is as many jobs as 
+*are left, at most batchSize. In the drain mode the batches start at MINBATCH and double
+*every time, and if the jobs left don't fill the window with full batches they are 
+*spread evenly over it instead.
+*
+*Input: 
+*	a: jobs left to ask for
+*
+*Return: 
+*the number of jobs in the next batch
+*/
+int nextBatch(int numJobs) {
+
+	int batch = batchSize;
+	if (drain) {
+		int spread = numJobs / window + (numJobs % window != 0);
+		batch = autoBatch < spread ? autoBatch : spread;
+		if (autoBatch < batchSize) autoBatch = 2 * autoBatch < batchSize ? 2 * autoBatch : batchSize;
+	}
+	return numJobs < batch ? numJobs : batch;
+}
+
+/*This function splits numJobs into batches of at most batchSize jobs and calls askForJobs
+*for up to window batches before any of them are executed. Each time the oldest batch is 
+*executed by calling executeJob once per job, its credit is used to ask for the next batch.
+*The loop is broken if executeJob returns -1 (error) or 1 (end of file). The returnValue 
+*is then returned, and it will be 0 if the ammount of jobs the user wanted actually got 
+*executed, 1 if the server ran out of jobs and -1 for error.
 *
 *Input: 
 *	a: number of jobs to be executed
 *
-*Return: none
+*Return: 
+*0 for success, 1 for end of file, -1 for error
 */
 int readLoop(int numJobs) {
 
-	testValue = askForJobs(numJobs);
-	for (int i = numJobs; i != 0 && testValue == 0; i--) testValue = executeJob();
-	return testValue;
+	int batches[MAXWINDOW], first = 0, outstanding = 0;
+
+	for (;;) {
+
+		/*Use the free credits*/
+		while (numJobs > 0 && outstanding < window) {
+			int batch = nextBatch(numJobs);
+			if (askForJobs(batch) == -1) return -1;
+			batches[(first + outstanding++) % MAXWINDOW] = batch;
+			numJobs -= batch;
+		}
+		if (outstanding == 0) {
+			if (threads) wakeWorkers();
+			else if (waitForEvents(WAITQUEUES, 0) == -1) return -1;
+			return 0;
+		}
+
+		/*Execute the oldest batch, wich frees its credit*/
+		for (int i = batches[first]; i != 0; i--) {
+			testValue = executeJob();
+			if (testValue != 0) return testValue;
+		}
+		first = (first + 1) % MAXWINDOW;
+		outstanding--;
+	}
 }
 
 /*This function sends a message to the server asking for numJobs messages.
 *The maximum ammount of messages i decided to be possible to ask for at once
 *is 255. A char array is created and filled with a GETJOB message and a char 
-*with a numJob int value
+*with a numJob int value. In version 2 numJobs is four bytes instead.
 *
 *Input:
 *	a: number of jobs to ask for
@@ -384,22 +940,23 @@ int readLoop(int numJobs) {
 */
 int askForJobs(int numJobs) {
 
-	char jobs[2];
+	char jobs[5];
 	jobs[0] = GETJOB;
+	if (protocolVersion == 2) {
+		putLength(jobs + 1, numJobs);
+		return writeToFileDescriptor(clientSocket, jobs, 5);
+	}
 	jobs[1] = (unsigned char)numJobs;
 
-	return writeToFileDescriptor(clientSocket, jobs, sizeof(jobs));
+	return writeToFileDescriptor(clientSocket, jobs, 2);
 }
 
-/*This function performs the jobs given by the server. First it reads in jobType and textLength
-*from server. Then it determines what type of job to execute by calling the function jobChooser.
-*If jobChooser returns -1 it means that there were an error, and -1 is returned. If jobChooser 
-*returns 2 then that means that children are being terminated and 1 is returned. The only values
-*jobChooser can then return is 0 or 1 and that is the child/pipe nr. that is being written to.
-*Then the jobtext is read, and textlength and jobtext is written to pipe/child with nr. jobValue.
+/*This function performs the jobs given by the server. First it takes the next frame, wich is
+*jobType, textLength and jobtext, from nextJob. Then the jobType is looked up in the table
+*of job types, and the function found there executes the job. 
 *
-*jobType = buffer[0];
-*textLength = (int)buffer[1];
+*jobType = frame[0];
+*textLength = (int)frame[1] or four bytes from frame[1];
 *
 *
 *Input: none
@@ -409,55 +966,378 @@ int askForJobs(int numJobs) {
 */
 int executeJob() {
 
-	/*Read jobtype and textlength from server*/
-	char buffer[2];
-	if (readFromFileDescriptor(clientSocket, buffer, 2) == -1) return -1;
+	size_t length;
+	int *release;
+	char *frame = nextJob(&length, &release);
+	if (frame == NULL) return -1;
 
-	/*Determine what type to execute*/
-	int jobValue = jobChooser(buffer[0]);
-	if (jobValue == -1) return -1;
-	else if (jobValue == 2) { 
-		terminateChildren();
-		return 1;
-	} 
+	struct jobRoute *r = &jobRoutes[(unsigned char) frame[0]];
+	if (r->execute == NULL) {
+		printf("ERROR: Don't know job-type: %c\n", frame[0]);
+		return -1;
+	}
+	return r->execute(frame, length, release, r->target);
+}
+
+/*This function fills in the table of job types. Every type in jobTypes goes to the
+*child or worker type with the same number, TERMINATECHILDREN stops them and GETRANGE
+*is the answer to a range.
+*
+*Input: none
+*
+*Return: none
+*/
+void registerJobTypes() {
+
+	for (int i = 0; i < CHILDREN; i++) registerJobType(jobTypes[i], consumerJob, i);
+	registerJobType(TERMINATECHILDREN, quitJob, 0);
+	registerJobType(GETRANGE, rangeJob, 0);
+}
+
+/*This function adds a job type to the table.
+*
+*Input: 
+*	a: job type
+*	b: function that executes the jobs of the type
+*	c: child or worker type the jobs go to
+*
+*Return: none
+*/
+void registerJobType(char type, int (*execute)(char *frame, size_t length, int *release, int target), int target) {
+
+	jobRoutes[(unsigned char) type].execute = execute;
+	jobRoutes[(unsigned char) type].target = target;
+}
+
+/*This function gives a job to the child or worker type nr. target. Textlength, as four 
+*bytes, and jobtext is put in the queue of the child. With worker threads a worker only
+*gets a pointer to the jobtext.
+*
+*Input: 
+*	a: frame
+*	b: length of frame
+*	c: counter of the buffer the frame is in
+*	d: child or worker type
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int consumerJob(char *frame, size_t length, int *release, int target) {
+
+	size_t headerLen = jobHeader;
+	drained++;
+	drainedBytes += length - headerLen;
+	if (threads) return handToWorker(target, frame+headerLen, length-headerLen, release);
+	return queueJob(target, frame+headerLen, length-headerLen);
+}
+
+/*This function adds a job to the queue of a child. If the queue doesn't have room for
+*it the parent waits for events until the child has taken enough.
+*
+*Input: 
+*	a: child nr.
+*	b: jobtext
+*	c: textlength, FINISHED to stop the child
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int queueJob(int child, char *text, size_t length) {
+
+	struct pipeQueue *q = &pipeQueues[child];
+	if (PIPEQUEUESIZE - (q->end - q->start) < 4 + length && waitForEvents(child, 4 + length) == -1) return -1;
+	if (PIPEQUEUESIZE - q->end < 4 + length) {
+		memmove(q->data, q->data + q->start, q->end - q->start);
+		q->end -= q->start;
+		q->start = 0;
+	}
+	putLength(q->data + q->end, length);
+	memcpy(q->data + q->end + 4, text, length);
+	q->end += 4 + length;
+	return 0;
+}
 
-	/*Read text from server*/
-	char jobText[(int)((unsigned char)buffer[1])+1];
-	jobText[0] = buffer[1];
-	if (readFromFileDescriptor(clientSocket, jobText+1, sizeof(jobText)-1) == -1) return -1;
+/*This function writes as much of the queue of a child as the pipe has room for, without
+*waiting. If it fails an error message is printed.
+*
+*Input: 
+*	a: child nr.
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int writeQueue(int child) {
+
+	struct pipeQueue *q = &pipeQueues[child];
+	while (q->end > q->start) {
 
-	/*First write text length and then jobtext to pipe*/
-	return writeToFileDescriptor(fd[jobValue][WRITE], jobText, sizeof(jobText));
+		ssize_t written = write(fd[child][WRITE], q->data + q->start, q->end - q->start);
+		if (written == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN) return 0;
+			perror("write()");
+			return -1;
+		}
+		q->start += written;
+	}
+	q->start = q->end = 0;
+	return 0;
 }
 
-/*This function creates an char array with all know job-types.
-*It then loops through the array and sees if it's a match between
-*a job-type and the job type provided as an argument.
+/*This function is the event loop of the parent. The queues are written to the pipes that
+*have room, and the pipes that don't are watched until they do. It returns when the
+*parent can go on: when the queue of child nr. until has room for need bytes, when every
+*queue is empty (WAITQUEUES) or when the socket is readable (WAITSERVER). While it waits
+*for a queue the socket is read into the free end of the receive buffer, wich doesn't
+*move the job that is being queued. With shared memory the ring holds the rest instead.
 *
 *Input: 
-*	a: type of job
+*	a: child nr., WAITQUEUES or WAITSERVER
+*	b: bytes the queue of the child needs
 *
 *Return: 
-*0 for job-type 1 (STDOUTCHILD1)
-*1 for job-type 2 (STDERRCHILD2)
-*2 for job-type 3 (TERMINATECHILDREN)
-*-1 if none of the alternatives matched
+*0 on success, -1 for error
 */
-int jobChooser(char jobType) {
+int waitForEvents(int until, size_t need) {
+
+	struct recvBuffer *rb = &serverInput[current];
+	for (;;) {
+
+		int waiting = 0;
+		for (int i = 0; i < CHILDREN; i++) {
+			struct pipeQueue *q = &pipeQueues[i];
+			if (writeQueue(i) == -1) return -1;
+			if (watchFd(fd[i][WRITE], &q->watched, q->end > q->start, EPOLLOUT) == -1) return -1;
+			waiting += q->end > q->start;
+		}
+		if (until >= 0 && PIPEQUEUESIZE - (pipeQueues[until].end - pipeQueues[until].start) >= need) return 0;
+		if (until == WAITQUEUES && waiting == 0) return 0;
 
-	char jobs[3] = {STDOUTCHILD1, STDERRCHILD2, TERMINATECHILDREN};
+		int readAhead = until >= 0 && serverLink.h == NULL && !serverClosed && rb->end < sizeof(rb->data);
+		if (watchFd(clientSocket, &socketWatched, until == WAITSERVER || readAhead, EPOLLIN) == -1) return -1;
 
-	for (int i = 0; i < (int)(sizeof(jobs)/sizeof(jobs[0])); i++) {
-		if (jobType == jobs[i]) return i;
+		struct epoll_event events[CHILDREN + 1];
+		int ready = epoll_wait(parentEpoll, events, CHILDREN + 1, -1);
+		if (ready == -1) {
+			if (errno == EINTR) continue;
+			perror("epoll_wait()");
+			return -1;
+		}
+		for (int i = 0; i < ready; i++) {
+
+			if (events[i].data.fd != clientSocket) continue; //The pipes are written above
+			if (until == WAITSERVER) return 0;
+
+			ssize_t received = recv(clientSocket, rb->data + rb->end, sizeof(rb->data) - rb->end, 0);
+			if (received > 0) rb->end += received;
+			else if (received == 0) serverClosed = 1; //Noticed when the buffer runs out
+			else if (errno != EINTR && errno != EAGAIN) {
+				perror("recv()");
+				return -1;
+			}
+		}
 	}
-	printf("ERROR: Don't know job-type: %c\n", jobType);
-	return -1;
 }
 
-/*This function initializes a loop wich in practice means that as long as none of the 
-*two reading operations in the loop returns an error, it continiues. In the loop 
-*the length of the text is read before the whole text is read. There is one extra space
-*allocated for the nullbyte. Then childPrint is called with the jobtext as an argument.
+/*This function adds a descriptor to parentEpoll or takes it out, if it isn't already.
+*
+*Input: 
+*	a: descriptor
+*	b: wether it is in parentEpoll now
+*	c: 1 to watch it, 0 not to
+*	d: events to watch
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int watchFd(int fd, int *watched, int on, uint32_t events) {
+
+	if (*watched == on) return 0;
+	struct epoll_event ev = {.events = events, .data.fd = fd};
+	if (epoll_ctl(parentEpoll, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, fd, &ev) == -1) {
+		perror("epoll_ctl()");
+		return -1;
+	}
+	*watched = on;
+	return 0;
+}
+
+/*This function takes the next job frame. Jobs that are left from a RECORDS frame or a 
+*compressed frame come first, then the receive buffer. Only if there is no complete frame
+*left in it the buffer is filled from the server with one big recv(). A compressed frame 
+*is uncompressed by unpack, and its jobs are taken from then on. The records of a RECORDS
+*frame are taken where they are, one by one, as version 1 frames. The counter that tells
+*when the workers are done with the buffer the frame is in is returned as well, and the 
+*length of the header of the frame is left in jobHeader.
+*
+*Input: 
+*	a: where the length of the frame is returned
+*	b: where the counter of the buffer is returned
+*
+*Return: 
+*the frame, NULL for error
+*/
+char * nextJob(size_t *length, int **release) {
+
+	for (;;) {
+
+		if (recordsLeft > 0) {
+			*length = recordsLeft >= V1HEADER ? V1HEADER + (unsigned char) records[1] : 0;
+			if (*length <= V1HEADER || *length > recordsLeft) {
+				printf("ERROR: Broken records frame\n");
+				return NULL;
+			}
+			char *frame = records;
+			records += *length;
+			recordsLeft -= *length;
+			*release = recordsRelease;
+			jobHeader = V1HEADER;
+			return frame;
+		}
+
+		char *frame = nextFrame(&unpacked[unpackedCurrent], length);
+		if (frame != NULL) {
+			*release = &unpackedInUse[unpackedCurrent];
+			jobHeader = V2HEADER;
+			return frame;
+		}
+
+		frame = nextFrame(&serverInput[current], length);
+		if (frame == NULL) {
+			testValue = receiveMore();
+			if (testValue <= 0) {
+				if (testValue == 0) printf("Server closed the connection\n");
+				return NULL;
+			}
+		}
+		else if (frame[0] == RECORDS && (features & FEATURERECORDS)) {
+			records = frame + V2HEADER;
+			recordsLeft = *length - V2HEADER;
+			recordsRelease = &inUse[current];
+		}
+		else if (frame[0] != COMPRESSED) {
+			*release = &inUse[current];
+			jobHeader = serverInput[current].headerLen;
+			return frame;
+		}
+		else if (unpack(frame, *length) == -1) return NULL;
+	}
+}
+
+/*This function uncompresses a 'Z' frame, wich holds whole jobs. With worker threads the
+*two buffers for uncompressed jobs take turns, like the receive buffers, so the other
+*one is used once the workers are done with it.
+*
+*Input: 
+*	a: frame
+*	b: length of frame
+*
+*Return: 
+*0 for success, -1 for error
+*/
+int unpack(char *frame, size_t length) {
+
+	uint32_t raw = getLength(frame + V2HEADER);
+	if (!(features & FEATURECOMPRESS) || length < PACKHEADER || raw > RECVBUFSIZE) {
+		printf("ERROR: Unexpected compressed frame\n");
+		return -1;
+	}
+	if (threads) {
+		unpackedCurrent = 1 - unpackedCurrent;
+		waitForRelease(&unpackedInUse[unpackedCurrent]);
+	}
+
+	struct recvBuffer *to = &unpacked[unpackedCurrent];
+	zs.next_in = (Bytef *) frame + PACKHEADER;
+	zs.avail_in = length - PACKHEADER;
+	zs.next_out = (Bytef *) to->data;
+	zs.avail_out = raw;
+	if (inflateReset(&zs) != Z_OK || inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.avail_out != 0) {
+		printf("ERROR: Broken compressed frame\n");
+		return -1;
+	}
+	to->start = 0;
+	to->end = raw;
+	return 0;
+}
+
+/*This function receives more from the server. With worker threads it first switches to
+*the other receive buffer, and waits until the workers are done with the jobs in it. The
+*part of a frame at the end of the current buffer is moved over to the other one. With
+*children the queues are written while the parent waits for the socket. With shared
+*memory it is taken from the ring instead of the socket, once the queues are empty.
+*
+*Input: none
+*
+*Return: 
+*number of bytes received, 0 if the server closed, -1 for error
+*/
+int receiveMore() {
+
+	if (threads) {
+
+		int other = 1 - current;
+		waitForRelease(&inUse[other]);
+
+		struct recvBuffer *from = &serverInput[current], *to = &serverInput[other];
+		to->start = 0;
+		to->end = from->end - from->start;
+		memcpy(to->data, from->data + from->start, to->end);
+		from->start = from->end = 0;
+		current = other;
+	}
+	else if (waitForEvents(serverLink.h != NULL ? WAITQUEUES : WAITSERVER, 0) == -1) return -1;
+	if (serverLink.h != NULL) return shmFill(&serverLink, clientSocket, &serverInput[current]);
+	return fillRecvBuffer(clientSocket, &serverInput[current]);
+}
+
+/*This function executes the job the server sends when there are no more jobs, and
+*stops the children or workers.
+*
+*Input: 
+*	a: frame
+*	b: length of frame
+*	c: counter of the buffer the frame is in
+*	d: not used
+*
+*Return: 
+*1 for end of file
+*/
+int quitJob(char *frame, size_t length, int *release, int target) {
+
+	(void) frame; (void) length; (void) release; (void) target;
+	terminateChildren();
+	return 1;
+}
+
+/*This function executes the answer to a GETRANGE request, wich has the number of jobs in
+*the range.
+*
+*Input: 
+*	a: frame
+*	b: length of frame
+*	c: counter of the buffer the frame is in
+*	d: not used
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int rangeJob(char *frame, size_t length, int *release, int target) {
+
+	(void) release; (void) target;
+	if (length != RANGEFRAME || rangeLeft >= 0) {
+		printf("ERROR: Unexpected range answer\n");
+		return -1;
+	}
+	rangeLeft = getLength(frame + V2HEADER);
+	return 0;
+}
+
+/*This function executes the next job from the pipe. The pipe is read in large chunks 
+*into a buffer, and every job in it is a four byte length followed by the text, so the
+*child doesn't need two reads for every job. When the buffer doesn't have a whole job
+*more is read, and if the pipe is empty the sink is flushed before the child waits for
+*it. A text length of 0 (FINISHED) means that the parent wants the child to stop.
 *
 *Input: none
 *
@@ -466,31 +1346,63 @@ int jobChooser(char jobType) {
 */
 int childTask() {
 
-	char buffer[1];
-	if (readFromFileDescriptor(fd[childNR][READ], buffer, sizeof(buffer)) == -1) return -1;
-
-	char b[(int)((unsigned char)buffer[0])+1];
-	if (readFromFileDescriptor(fd[childNR][READ], b, (sizeof(b)-1)) == -1) return -1; 
-	b[(int)((unsigned char)buffer[0])] = '\0';
+	static char pipeData[RECVBUFSIZE + 4];
+	static size_t start, end;
+
+	for (;;) {
+
+		if (end - start >= 4) {
+			uint32_t textLength = getLength(pipeData + start);
+			if (textLength == FINISHED) return -1; //Parent tells child to stop
+			if (textLength > RECVBUFSIZE) {
+				printf("A job is larger than the pipe buffer (%d bytes)\n", RECVBUFSIZE);
+				return -1;
+			}
+			if (end - start >= 4 + textLength) {
+				childPrint(childNR, pipeData + start + 4, textLength);
+				start += 4 + textLength;
+				return 0;
+			}
+		}
+		if (start > 0) {
+			memmove(pipeData, pipeData + start, end - start);
+			end -= start;
+			start = 0;
+		}
 
-	childPrint(b);
-	return 0;
+		ssize_t testValue = read(fd[childNR][READ], pipeData + end, sizeof(pipeData) - end);
+		if (testValue > 0) end += testValue;
+		else if (testValue == 0) return -1;
+		else if (errno == EAGAIN) {
+			sinkFlush(0);
+			struct pollfd p = {fd[childNR][READ], POLLIN, 0};
+			if (poll(&p, 1, -1) == -1 && errno != EINTR) {
+				perror("poll()");
+				return -1;
+			}
+		}
+		else if (errno != EINTR) {
+			perror("read()");
+			return -1;
+		}
+	}
 }
 
-/*This function prints out message to stdout if its child 0 who is
-*trying to print or stderr if its child 1.
+/*This function adds the message to the output of the child or worker, wich goes to 
+*stdout if its child 0 who is trying to print or stderr if its child 1, or to the 
+*files of their types. The message doesn't have to end with a nullbyte, since worker
+*threads print it straight from the receive buffer.
 *
 *Input: 
-*	a: message to be printed out
+*	a: child nr., or type of worker
+*	b: message to be printed out
+*	c: length of the message
 *
 *Return: none
 */
-void childPrint(char *msg) {
+void childPrint(int child, char *msg, int length) {
 
-	if (strcmp(msg, "") != 0) {
-		if (childNR == 0) fprintf(stdout, "%s\n", msg);
-		else if (childNR == 1) fprintf(stderr, "%s\n", msg);
-	}
+	if (length > 0 && child >= 0 && child < CHILDREN) sinkWrite(child, msg, length);
 }
 
 /*This function can execute two different ways; 
@@ -504,6 +1416,10 @@ void childPrint(char *msg) {
 *they take care of that themself. The parent does however wait for the children to terminate
 *before terminating the whole program. 
 *
+*With worker threads there are no pipes or children, and the workers are stopped unless
+*it's called from the signal handler. In the drain mode the summary is printed when the
+*children or workers are done.
+*
 *Apart from that the previously malloced space is freed if necessary. The server gets sent a 
 *message informing about the termination before the socket is closed. After that the program terminates. 
 *
@@ -514,12 +1430,14 @@ void childPrint(char *msg) {
 */
 void terminator(char msg) {
 
- 	closeNPipes();
+	if (!threads && parent && sigHandlerCalled != 1 && pipeQueues[0].data != NULL) waitForEvents(WAITQUEUES, 0);
+ 	if (!threads) closeNPipes();
 	
 	if (parent) {
 
 		if (input != NULL) free(input);
-		if (childStatus(children) == ALIVE && sigHandlerCalled != 1) terminateChildren();
+		if ((threads || childStatus(children) == ALIVE) && sigHandlerCalled != 1) terminateChildren();
+		if (drain && drainStart.tv_sec != 0) drainSummary(); //Not if it never started
 
 		if (socketConnection == CONNECTED) {
 			char buffer[1] = {msg};
@@ -527,22 +1445,41 @@ void terminator(char msg) {
 		}
 		close(clientSocket);
 
-		if (sigHandlerCalled == 1) wait(NULL);
+		if (sigHandlerCalled == 1 && !threads) wait(NULL);
 
 		if (msg == NORMALTERMINATE) exit(EXIT_SUCCESS);
 		else exit(EXIT_FAILURE);
 	}
 	else {
+		sinkRescue();
 		raise(SIGKILL);
 	}
 }
 
+/*This function prints the summary of the drain mode: how many jobs were executed, how
+*long it took and the throughput.
+*
+*Input: none
+*
+*Return: none
+*/
+void drainSummary() {
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double seconds = (now.tv_sec - drainStart.tv_sec) + (now.tv_nsec - drainStart.tv_nsec) / 1e9;
+	if (seconds <= 0) seconds = 1e-9;
+	printf("\n---Drained %ld jobs (%ld bytes) in %.3f s: %.0f jobs/s, %.1f MB/s---\n", 
+		drained, drainedBytes, seconds, drained / seconds, drainedBytes / seconds / 1e6);
+}
+
 /*This function first checks if the children are alive. If not it 
 *terminates all child processes by looping through all children, wich 
 *are already saved in an array from when they were initialized, and 
 *waiting for that child to finish before sendig a kill signal. If 
 *this termination isn't from a sig handler then a message is sent to 
-*the pipe to make it finish. 
+*the pipe to make it finish. Worker threads are stopped after they are
+*done with the jobs they already have.
 *
 *Input: none
 *
@@ -550,13 +1487,20 @@ void terminator(char msg) {
 */
 void terminateChildren() {
 
+	if (threads) {
+		stopWorkers();
+		sinkClose();
+		return;
+	}
 	if (childStatus(children) == DEAD) return;
 
-	char buffer[1] = {FINISHED};
+	if (sigHandlerCalled != 1 && pipeQueues[0].data != NULL) {
+		for (int i = 0; i < CHILDREN; i++) queueJob(i, "", FINISHED);
+		waitForEvents(WAITQUEUES, 0);
+	}
 
 	for (int i = 0; i < CHILDREN; i++) {
 
-		if (sigHandlerCalled != 1) write(fd[i][WRITE], buffer, sizeof(buffer));
 		waitpid(children[i], NULL, 0);
 		kill(children[i], SIGKILL);
 	}
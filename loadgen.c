@@ -0,0 +1,450 @@
+/*H**********************************************************************
+* FILENAME:		loadgen.c
+*
+* COMPILE:		Make
+*
+* RUN:			./loadgen [-c <connections>] [-b <batch>] [-n <jobs>] [-z]
+*			<hostname> <port>
+*
+* NOTES:
+*	LOAD:		Opens <connections> connections (default 8) to the server
+*			that speak protocol version 2. Each of them asks for
+*			batches of <batch> jobs (default 4096), one batch at a
+*			time, until the server has no jobs left or the connection
+*			got <jobs> jobs. All connections are served by one epoll
+*			loop, and the jobs are only counted, not executed, so it
+*			is the server and the network that are measured. With -z
+*			the batches are asked for compressed, otherwise the jobs
+*			may come as RECORDS frames, like they do for the klient.
+*			A connection that is refused is tried again for a while,
+*			so loadgen can be started together with the server.
+*
+*	REPORT:		When every connection is done, or on (ctrl+c), the jobs
+*			per second, the bytes per second of job text and of what
+*			was received, and the 50th, 99th and 99.9th percentile
+*			of the batch latency are printed. The latency of a batch
+*			is from the GETJOB until its last job arrived.
+*
+*
+* AUTHOR: 		15119
+*
+*H*/
+
+#define _GNU_SOURCE
+
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <zlib.h>
+#include "communication.h"
+
+#define EMPTYFILE ((char) 'Q')
+#define MAXEVENTS 64
+#define CONNECTTRIES 200	//Tries to connect while the server starts,
+#define CONNECTPAUSE 50		//this many ms apart
+
+struct connection {
+	int sock;
+	struct recvBuffer in;
+	uint32_t waiting;	//Jobs of the current batch that haven't arrived
+	long jobs;
+	struct timespec asked;
+	int done;
+};
+
+struct connection *connections;
+int connectionCount = 8, active, compressed;
+uint32_t batchSize = MAXJOBSV2;
+long maxJobs;
+long totalJobs, textBytes, wireBytes;
+uint64_t *latencies;
+size_t latencyCount, latencyCap;
+struct timespec started;
+char unpacked[RECVBUFSIZE];
+z_stream zs;
+
+int parseOptions(int argc, char *argv[]);
+int openConnection(struct connection *c, char *address);
+int askForJobs(struct connection *c);
+int received(struct connection *c);
+int countJobs(struct connection *c, char *frame, size_t length);
+int batchDone(struct connection *c);
+void finish(struct connection *c);
+int addLatency(uint64_t latency);
+uint64_t nanoseconds(struct timespec *from);
+int compareLatency(const void *a, const void *b);
+void report();
+
+/*This is the main method wich opens the connections, asks for the first batch on each
+*of them and then receives until every connection is done. Then the report is printed.
+*
+*Input:
+*	a: number of arguments
+*	b: arguments
+*
+*Return:
+*EXIT_SUCCESS, or EXIT_FAILURE for errors
+*/
+int main(int argc, char *argv[]) {
+
+	if (parseOptions(argc, argv) == -1 || argc - optind != 2 || (port = atoi(argv[optind+1])) == 0) {
+		printf("Correct usage: ./loadgen [-c <connections>] [-b <batch>] [-n <jobs>] [-z] <hostname> <port>\n");
+		return EXIT_FAILURE;
+	}
+	if (init_sig_handler() == -1) return EXIT_FAILURE;
+
+	struct hostent *host = gethostbyname(argv[optind]);
+	if (host == NULL || host->h_addr_list[0] == NULL) {
+		printf("gethostbyname(): couldn't find %s\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+	char *address = inet_ntoa(*(struct in_addr *) host->h_addr_list[0]);
+	if (compressed && inflateInit(&zs) != Z_OK) return EXIT_FAILURE;
+
+	int epollFd = epoll_create1(0);
+	connections = calloc(connectionCount, sizeof(struct connection));
+	if (epollFd == -1 || connections == NULL) {
+		perror("epoll_create1()/calloc()");
+		return EXIT_FAILURE;
+	}
+	for (int i = 0; i < connectionCount; i++) {
+		struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &connections[i]};
+		if (openConnection(&connections[i], address) == -1) return EXIT_FAILURE;
+		if (epoll_ctl(epollFd, EPOLL_CTL_ADD, connections[i].sock, &ev) == -1) {
+			perror("epoll_ctl()");
+			return EXIT_FAILURE;
+		}
+	}
+	socketConnection = CONNECTED;
+
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	for (int i = 0; i < connectionCount; i++) {
+		if (askForJobs(&connections[i]) == -1) return EXIT_FAILURE;
+	}
+	active = connectionCount;
+
+	struct epoll_event events[MAXEVENTS];
+	while (active > 0) {
+		int n = epoll_wait(epollFd, events, MAXEVENTS, -1);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			perror("epoll_wait()");
+			return EXIT_FAILURE;
+		}
+		for (int i = 0; i < n; i++) {
+			if (received(events[i].data.ptr) == -1) return EXIT_FAILURE;
+		}
+	}
+	report();
+	return EXIT_SUCCESS;
+}
+
+/*This function reads the options. If an option is unknown or has an invalid value
+*-1 (error) is returned.
+*
+*Input:
+*	a: number of arguments
+*	b: arguments
+*
+*Return:
+*0 for success, -1 for error
+*/
+int parseOptions(int argc, char *argv[]) {
+
+	int opt;
+	while ((opt = getopt(argc, argv, "c:b:n:z")) != -1) {
+		if (opt == 'c') connectionCount = atoi(optarg);
+		else if (opt == 'b') batchSize = atoi(optarg);
+		else if (opt == 'n') maxJobs = atol(optarg);
+		else if (opt == 'z') compressed = 1;
+		else return -1;
+	}
+	if (connectionCount < 1 || batchSize < 1 || maxJobs < 0) {
+		printf("The connections, batch and jobs have to be positive\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*This function connects to the server and says hello with protocol version 2. As long as
+*the connection is refused it is tried again, CONNECTPAUSE ms apart, since the server may
+*still be indexing its job file.
+*
+*Input:
+*	a: connection
+*	b: IP-address of the server
+*
+*Return:
+*0 for success, -1 for error
+*/
+int openConnection(struct connection *c, char *address) {
+
+	for (int tries = 1; ; tries++) {
+		if ((c->sock = createSocket(address, port)) == -1) return -1;
+		if (connect(c->sock, (struct sockaddr *) &serverAddr, addr_size) == 0) break;
+		if (errno != ECONNREFUSED || tries == CONNECTTRIES) {
+			perror("connect()");
+			return -1;
+		}
+		close(c->sock);
+		struct timespec pause = {0, CONNECTPAUSE * 1000000L};
+		nanosleep(&pause, NULL);
+	}
+
+	char hello[HELLOLENGTH];
+	hello[0] = HELLO;
+	hello[1] = PROTOCOLVERSION;
+	putLength(hello + 2, compressed ? FEATURECOMPRESS : FEATURERECORDS);
+	if (writeToFileDescriptor(c->sock, hello, sizeof(hello)) == -1) return -1;
+	if (readFromFileDescriptor(c->sock, hello, sizeof(hello)) == -1) return -1;
+	if (hello[0] != HELLO || hello[1] != PROTOCOLVERSION) {
+		printf("The server doesn't speak protocol version %d\n", PROTOCOLVERSION);
+		return -1;
+	}
+	c->in.headerLen = V2HEADER;
+	return 0;
+}
+
+/*This function asks for the next batch on a connection, no more than the connection
+*has left of its jobs, and notes when it was asked for.
+*
+*Input:
+*	a: connection
+*
+*Return:
+*0 for success, -1 for error
+*/
+int askForJobs(struct connection *c) {
+
+	c->waiting = batchSize;
+	if (maxJobs > 0 && maxJobs - c->jobs < (long) batchSize) c->waiting = maxJobs - c->jobs;
+
+	char msg[5];
+	msg[0] = GETJOB;
+	putLength(msg + 1, c->waiting);
+	clock_gettime(CLOCK_MONOTONIC, &c->asked);
+	return writeToFileDescriptor(c->sock, msg, sizeof(msg));
+}
+
+/*This function receives what the server sent on a connection and counts the jobs in it.
+*
+*Input:
+*	a: connection
+*
+*Return:
+*0 for success, -1 for error
+*/
+int received(struct connection *c) {
+
+	int n = fillRecvBuffer(c->sock, &c->in);
+	if (n <= 0) {
+		if (n == 0) printf("The server closed a connection\n");
+		return -1;
+	}
+	wireBytes += n;
+
+	size_t length;
+	char *frame;
+	while (!c->done && (frame = nextFrame(&c->in, &length)) != NULL) {
+		if (countJobs(c, frame, length) == -1) return -1;
+	}
+	return 0;
+}
+
+/*This function counts a job frame, or the jobs in a compressed or a RECORDS frame. A 'Q'
+*from the server means that it has no jobs left, and ends the connection.
+*
+*Input:
+*	a: connection
+*	b: frame
+*	c: length of the frame
+*
+*Return:
+*0 for success, -1 for error
+*/
+int countJobs(struct connection *c, char *frame, size_t length) {
+
+	if (frame[0] == COMPRESSED) {
+
+		uint32_t raw = getLength(frame + V2HEADER);
+		zs.next_in = (Bytef *) frame + PACKHEADER;
+		zs.avail_in = length - PACKHEADER;
+		zs.next_out = (Bytef *) unpacked;
+		zs.avail_out = sizeof(unpacked);
+		if (raw > sizeof(unpacked) || inflateReset(&zs) != Z_OK || inflate(&zs, Z_FINISH) != Z_STREAM_END) {
+			printf("ERROR: Broken compressed frame\n");
+			return -1;
+		}
+		for (size_t pos = 0; pos + V2HEADER <= raw && !c->done; ) {
+			size_t jobLength = V2HEADER + getLength(unpacked + pos + 1);
+			if (pos + jobLength > raw) {
+				printf("ERROR: Broken compressed frame\n");
+				return -1;
+			}
+			if (countJobs(c, unpacked + pos, jobLength) == -1) return -1;
+			pos += jobLength;
+		}
+		return 0;
+	}
+
+	if (frame[0] == RECORDS) {
+
+		for (size_t pos = V2HEADER; pos < length && !c->done; ) {
+			if (pos + V1HEADER > length || pos + V1HEADER + (unsigned char) frame[pos + 1] > length) {
+				printf("ERROR: Broken records frame\n");
+				return -1;
+			}
+			size_t jobLength = V1HEADER + (unsigned char) frame[pos + 1];
+			c->jobs++;
+			totalJobs++;
+			textBytes += jobLength - V1HEADER;
+			pos += jobLength;
+			if (--c->waiting == 0 && batchDone(c) == -1) return -1;
+		}
+		return 0;
+	}
+
+	if (frame[0] == EMPTYFILE) {
+		finish(c);
+		return 0;
+	}
+
+	c->jobs++;
+	totalJobs++;
+	textBytes += length - V2HEADER;
+	if (--c->waiting == 0) return batchDone(c);
+	return 0;
+}
+
+/*This function notes the latency of a batch that has arrived, and asks for the next
+*one if the connection has jobs left.
+*
+*Input:
+*	a: connection
+*
+*Return:
+*0 for success, -1 for error
+*/
+int batchDone(struct connection *c) {
+
+	if (addLatency(nanoseconds(&c->asked)) == -1) return -1;
+
+	if (maxJobs > 0 && c->jobs >= maxJobs) {
+		finish(c);
+		return 0;
+	}
+	return askForJobs(c);
+}
+
+/*This function adds a latency to the samples, and grows the array of them when it is 
+*full.
+*
+*Input:
+*	a: latency
+*
+*Return:
+*0 for success, -1 for error
+*/
+int addLatency(uint64_t latency) {
+
+	if (latencyCount == latencyCap) {
+		size_t cap = latencyCap ? 2 * latencyCap : 1024;
+		uint64_t *l = realloc(latencies, cap * sizeof(uint64_t));
+		if (l == NULL) {
+			perror("realloc()");
+			return -1;
+		}
+		latencies = l;
+		latencyCap = cap;
+	}
+	latencies[latencyCount++] = latency;
+	return 0;
+}
+
+/*This function ends a connection. The last batch counts with the jobs it got. If its
+*latency can't be kept the connection is still ended.
+*
+*Input:
+*	a: connection
+*
+*Return: none
+*/
+void finish(struct connection *c) {
+
+	if (c->waiting > 0) addLatency(nanoseconds(&c->asked));
+	char msg[1] = {NORMALTERMINATE};
+	send(c->sock, msg, sizeof(msg), MSG_NOSIGNAL);
+	close(c->sock);
+	c->done = 1;
+	active--;
+}
+
+/*This function tells how long ago a point in time was.
+*
+*Input:
+*	a: the point in time
+*
+*Return:
+*nanoseconds since then
+*/
+uint64_t nanoseconds(struct timespec *from) {
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) (now.tv_sec - from->tv_sec) * 1000000000 + now.tv_nsec - from->tv_nsec;
+}
+
+/*This function compares two latencies for qsort.
+*
+*Input:
+*	a: first latency
+*	b: second latency
+*
+*Return:
+*negative, 0 or positive like strcmp
+*/
+int compareLatency(const void *a, const void *b) {
+
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+/*This function prints the throughput and the latency percentiles.
+*
+*Input: none
+*
+*Return: none
+*/
+void report() {
+
+	double seconds = nanoseconds(&started) / 1e9;
+	printf("%d connections, batches of %u jobs%s\n", connectionCount, batchSize, compressed ? ", compressed" : "");
+	printf("%ld jobs in %.3f s: %.0f jobs/s, %.1f MB/s of text, %.1f MB/s received\n", totalJobs, seconds,
+		totalJobs / seconds, textBytes / seconds / 1e6, wireBytes / seconds / 1e6);
+
+	if (latencyCount == 0) return;
+	qsort(latencies, latencyCount, sizeof(uint64_t), compareLatency);
+	double at[3] = {0.5, 0.99, 0.999};
+	printf("Batch latency over %zu batches:", latencyCount);
+	for (int i = 0; i < 3; i++) {
+		size_t k = (size_t) (at[i] * latencyCount);
+		if (k >= latencyCount) k = latencyCount - 1;
+		printf(" p%g %.1f us", at[i] * 100, latencies[k] / 1e3);
+	}
+	printf("\n");
+}
+
+/*This function is called by the signal handler on (ctrl+c), and prints the report of
+*what was received so far.
+*
+*Input:
+*	a: type of termination
+*
+*Return: none
+*/
+void terminator(char msg) {
+
+	report();
+	if (msg == NORMALTERMINATE) exit(EXIT_SUCCESS);
+	else exit(EXIT_FAILURE);
+}
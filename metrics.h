@@ -0,0 +1,39 @@
+/*H**********************************************************************
+* FILENAME:	metrics.h
+*
+* NOTES:	Counters and latency histograms of the server. They are 
+*		plain variables, and every thread that serves clients has
+*		its own, so the hot path has no locks or atomics.
+*
+* AUTHOR: 	15119
+*
+*H*/
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define HISTSUBBITS 3		//Every power of two is split in 2^HISTSUBBITS buckets
+#define HISTBUCKETS ((64 - HISTSUBBITS + 1) << HISTSUBBITS)
+
+struct histogram {
+	uint64_t buckets[HISTBUCKETS];
+	uint64_t count, sum, max;
+};
+
+struct metrics {
+	uint64_t accepted, closed;	//Connections
+	uint64_t requests, batches, jobs;
+	uint64_t bytes;			//Sent to clients
+	uint64_t writes, sendfiles, ringWrites, blocked;	//Syscalls, and how often the socket was full
+	uint64_t shmWrites;		//Copies into shared memory rings, not syscalls
+	uint64_t packedFrames, packedSaved;	//Compression
+	struct histogram batchBuild;	//fillBatch, wich is readFile for every job, in ns
+	struct histogram writeCall;	//writev() or sendfile(), in ns
+	struct histogram batchTotal;	//From making a batch until it is written, in ns
+};
+
+extern __thread struct metrics stats;
+
+uint64_t metricsNow();
+void histogramAdd(struct histogram *h, uint64_t value);
+void metricsDump(FILE *out, int thread);
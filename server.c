@@ -3,48 +3,427 @@
 * 
 * COMPILE:		Make
 *
-* RUN:			./server <address> <port>
+* RUN:			./server [-u | -z] [-r | -t <threads>] [-l <socket>] [-f]
+*			<filename | directory | 'pattern'> <port>
 * 
 * NOTES:
-* 	CONNECTION: 	As i understood the task, the server should only be 
-*			able to have one connection per execution. But if you
-*			wanted to expand, and make the server able to outlive
-*			multiple connections that is possible using a simple 
-*			loop.
+* 	CONNECTION: 	The server is long-lived and serves any number of
+*			clients at the same time. All sockets are non-blocking
+*			and driven by one epoll loop, so a slow client only
+*			holds up its own pending output and never the others.
 *
-*			If the client connected to the server experiences an 
-*			error mid-connection, then i think that is most likely
-*			an error caused while communicating with the server, and
-*			therfore i choose to terminate the server as well when
-*			that happens.
+*			All clients share the one file cursor behind readFile(),
+*			so every job is handed to exactly one client.
+*
+*			Every accepted socket gets TCP_NODELAY, since a batch is
+*			written at once and Nagle would only hold back its end.
+*
+*			If a client experiences an error mid-connection, then
+*			only that connection is closed, and the jobs of its 
+*			batch that weren't sent yet are given back to the shard
+*			for the other clients. The server itself only terminates
+*			on (ctrl+c) or on errors of its own.
+*
+*	THREADS:	With -t <threads> the server runs one event loop per 
+*			core instead, each in a thread pinned to its core, and 
+*			-t 0 takes every core the server may run on. Every thread
+*			has its own listening socket on the same port through
+*			SO_REUSEPORT, so the kernel spreads the connections over 
+*			them, and its own epoll, clients, ring and metrics, as
+*			thread-local variables. The job files are mapped and 
+*			indexed once, before the threads start, and the threads
+*			share them, but every thread has a cursor of its own and
+*			only serves its own range of the jobs of each of them, so
+*			a job is still handed to exactly one client. A shared job
+*			file isn't grown when it is written to again. A client 
+*			whose thread has no jobs left for it is handed over to 
+*			the next thread at the end of the round of the event 
+*			loop, through the inbox of that thread and its eventfd,
+*			and goes on with its request there. It is only told 
+*			there are no jobs left when it has been through every 
+*			thread since its last job, and the ranges only get 
+*			smaller, so by then they are all done. The signals are
+*			taken by the main thread, wich wakes the others through
+*			their eventfd. -r can't be used with it, since the state
+*			file has one cursor.
+*
+*	LOCAL:		With -l <socket> the server listens on a Unix socket as
+*			well. A client on it that asks for the shared memory 
+*			feature in its HELLO gets a ring in shared memory with
+*			the answer (see shmring.c), and its batches are copied 
+*			into the ring instead of written to the socket, so the
+*			server makes no syscalls for it as long as the klient
+*			keeps up. When the ring is full the client waits for 
+*			the eventfd the klient writes when it has made room, 
+*			instead of for its socket. The requests still come on
+*			the socket. -l can't be used with -t.
+*
+*	PROTOCOL:	A client that starts with a HELLO message speaks version
+*			2 of the protocol, wich has 32 bit text lengths, 32 bit 
+*			batch sizes and feature flags. The server answers with 
+*			the version and the features it agrees to. A client that 
+*			starts with anything else is an old version 1 client, 
+*			and gets the records exactly as they are in the file.
+*
+*			A version 2 client with the records feature gets the 
+*			jobs that follow each other in the file as one RECORDS
+*			frame, wich holds up to MAXRECORDS bytes of records as 
+*			they are in the file. So a batch is a few large pieces
+*			of the mapping, as for version 1, instead of a header 
+*			in memory and a short text for every job, and -z and 
+*			-u read the pieces from the file. The feature isn't 
+*			given together with compression, wich copies the jobs
+*			anyway.
+*
+*			The requests are found in a table with an entry for 
+*			every possible first byte, with the function that 
+*			executes it and its length in each version. A new 
+*			request is added with registerRequest(), and a byte 
+*			without an entry closes the client.
+*
+*	FILTERS:	A version 2 client that has the filter feature can send
+*			a FILTER message (see filter.c), and from then on only
+*			gets the jobs of the types in it whose jobtext starts
+*			with or contains its text. The jobs are checked before
+*			they are added to the output, so the others are never
+*			copied or sent. A job the client takes ahead of the 
+*			cursor is marked as taken in the shard, and the others 
+*			skip it, so the jobs it passes by are left for them. 
+*			The client remembers how far it has looked in every 
+*			shard, so no job is checked twice for it. It is told 
+*			there are no jobs left when no job left matches. A shard
+*			without jobs of the types in the filter is skipped at 
+*			once. No more than SCANLIMIT jobs are checked for a 
+*			client in one round of the event loop, so a filter that
+*			rarely matches doesn't hold up the other clients. If it 
+*			found nothing by then, the client goes on looking in the
+*			next round, wich doesn't wait for events while any 
+*			client does.
+*
+*	RANGES:		A version 2 client can ask for the jobs [first, first+count)
+*			with GETRANGE instead, by job number or by byte offset,
+*			whatever the cursor is at. A byte range gives the jobs
+*			whose records start in it, so ranges that cover the file
+*			give every job once. The range is found in the index,
+*			and the answer is a GETRANGE frame with the number of 
+*			jobs, followed by the jobs in batches like for GETJOB.
+*			Nothing is taken or moved: any client can fetch any 
+*			range, as often as it wants. With shards the numbers and
+*			offsets run through the shards in the order they were
+*			opened, as if they were one file. Jobs before the cursor
+*			that a resumed server hasn't indexed are left out.
+*
+*	SHARDS:		The jobs can be spread over several job files, called
+*			shards: all files in a directory, or the files that match
+*			a glob pattern. Each shard has its own mapping, index,
+*			cursor and state file, and so its own readahead from the
+*			kernel. A batch is taken from one shard, and the shards
+*			take turns, so consecutive batches read different files.
+*			New files that are moved or written into the directory 
+*			are added as shards while the server runs, through 
+*			inotify. Sidecar files and names starting with '.' are
+*			not shards.
+*
+*	FOLLOW:		With -f the job files are followed like tail -f: every
+*			shard is watched with inotify, and when it grows the
+*			new part is mapped and indexed, up to the last complete
+*			record. A record that is only half written is picked 
+*			up when the rest of it is there. A client that has jobs
+*			left of its request when there are none left in the 
+*			shards is not told so, but waits, and gets the new jobs
+*			as soon as they are indexed. A record with text length
+*			0 still ends the jobs of a file. The new files in a 
+*			directory of shards are added when they are created, 
+*			so they are followed from the start. A shard that gets
+*			smaller, because it was truncated or rotated, gives no
+*			more jobs. Nothing from past its new end is sent: a 
+*			batch that read there is made again, and a client whose
+*			output still points there is closed. -f can't be used 
+*			with -t, since the ranges of the threads are fixed.
+*
+*	INDEX:		If jobindex has made <filename>.idx for this version of
+*			the job file, the index and the number of jobs of every
+*			type are taken from it instead of walking the file.
+*
+*	RESUME:		With -r the first job that isn't delivered yet is saved
+*			in <filename>.state every CHECKPOINTMS milliseconds and
+*			when the server stops, and a restarted server continues
+*			from there, as long as the job file was at most 
+*			appended to. A job counts as delivered when the batch 
+*			it is in has been written to the socket, so jobs in 
+*			batches that were being sent when the server stopped 
+*			are sent again.
+*
+*	METRICS:	The server counts connections, requests, batches, jobs,
+*			bytes and write syscalls, and keeps histograms of the
+*			time it takes to make a batch, of every writev() or 
+*			sendfile(), and of a batch from when it is made until it
+*			is written. On SIGUSR1 they are written to stderr as one
+*			line of JSON, for example: kill -USR1 <pid>
+*
+*	BACKPRESSURE:	A client's next request is not read before the output
+*			of its previous request is written to the socket. A big
+*			request is sent in batches of at most BATCHJOBS jobs, and
+*			the next batch is only made when the previous one is 
+*			written.
+*
+*	IO_URING:	With -u the batches are sent through io_uring instead
+*			of writev(). Every batch is read from the job file into
+*			a registered buffer and written from it to the socket by 
+*			one linked chain, and the file and sockets are registered
+*			files. Pieces of the file smaller than RINGREADMIN, like
+*			single jobs for version 2 clients, are copied from the
+*			mapping instead of getting a read each. At the same time
+*			the kernel is asked to read ahead the part of the file
+*			the next batch will come from. All
+*			chains that are prepared in one round of the event loop
+*			are submitted together. If io_uring can't be set up the 
+*			server falls back to writev().
+*
+*	ZERO-COPY:	The records in the job file are already in the format
+*			that is sent to the client. With -z the part of a batch
+*			that comes from the job file is sent with sendfile() 
+*			straight from the file, found by the index, and never 
+*			copied through user space. Only the 'Q' message goes
+*			through writev(). A piece of the file that is smaller 
+*			than SENDFILEMIN, like the text of a single job sent to
+*			a version 2 client, goes through writev() as well.
+*
+*	COMPRESSION:	A version 2 client can ask for the compression feature
+*			in its HELLO. Then every batch is cut in pieces of whole
+*			jobs of at most PACKCHUNK bytes, and each piece is sent
+*			as one 'Z' frame with the piece compressed by zlib. A 
+*			piece that doesn't get at least 1/8 smaller is sent as 
+*			it is. When PACKMISSES batches in a row don't compress
+*			the next PACKPAUSE batches are sent without trying.
 *
 *
 * AUTHOR: 		15119
 *
 *H*/
 
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <zlib.h>
 #include "communication.h"
+#include "filter.h"
+#include "jobfile.h"
+#include "metrics.h"
+#include "shmring.h"
+#include "uring.h"
 
 #define EMPTYFILE ((char) 'Q')
+#define BATCHJOBS 4096
+#define SENDFILEMIN 16384
+#define FEATURES (FEATURECOMPRESS | FEATURESHM | FEATUREFILTER | FEATURERANGE | FEATURERECORDS)	//Protocol features this server supports
+#define PACKCHUNK 32768		//Jobs compressed into one frame, in bytes
+#define PACKMISSES 4
+#define PACKPAUSE 64
+#define PACKEDSIZE (BATCHJOBS * (V2HEADER + 255) + V2HEADER)	//A whole batch of the biggest jobs
+#define MAXEVENTS 64
+#define CHECKPOINTMS 1000
+#define SCANLIMIT 65536		//Jobs a filter checks for a client in one round of the event loop
+#define INBUFSIZE 512		//Room for the largest FILTER message
+#define RINGENTRIES 256
+#define RINGBUFFERS 64
+#define RINGBUFSIZE (128*1024)
+#define RINGREADMIN 4096
+#define CHAINREADS 32		//A chain must never be split by a submit
+#define MAXFIXEDFILES 65536
+#define READTAG 0
+#define WRITETAG 1
+#define SPACETAG 1		//Marks the epoll events of the spaceFd of a client
+
+/*A job of the batch being sent, and the output entry after its last one.*/
+struct batchJob {
+	size_t job;
+	int end;
+};
+
+struct client {
+	int sock;
+	char in[INBUFSIZE];	//Unparsed bytes read from the client
+	size_t inLen;
+	int version;		//0 until the first message tells
+	uint32_t features;
+	uint32_t remaining;	//Jobs left of the current request
+	struct iovec *iov;	//Pending output, pointing into the mapped job file
+	int iovCount, iovPos, iovCap;
+	char *headers;		//Version 2 headers of the batch being sent
+	size_t headersLen;
+	char *run;		//Header of the RECORDS frame that jobs are added to, NULL if none
+	z_stream zs;		//Compression state, with the compression feature
+	char *packed;		//Compressed frames of the batch being sent
+	size_t packedLen;
+	int packMisses, packPause;
+	struct jobFile *batchShard;	//Shard the batch being sent is taken from
+	size_t batchFirst;	//First job of it
+	int batchOpen;
+	struct batchJob *batchJobs;	//The jobs it took, BATCHJOBS at most
+	int batchJobCount;
+	uint64_t batchMade;	//When it was made
+	int buffer;		//Registered buffer used with io_uring, -1 for none
+	int inflight;		//io_uring requests that haven't completed
+	int failed, closing, waiting;
+	size_t sendLen, sent;
+	int sendPos;		//First output entry in the registered buffer
+	int local;		//Connected through the Unix socket
+	struct shmLink link;	//Shared memory ring, link.h is NULL without it
+	int spaceWatched;	//Waiting for room in the ring
+	int closed;		//Freed at the end of the round of the event loop
+	struct jobFilter *filter;	//NULL for every job
+	size_t *scan;		//How far the filter has looked in every shard
+	int scanCap;
+	size_t *batchScan;	//That of the shard of the batch
+	size_t scanLeft;	//Jobs the filter may still check in this round
+	uint64_t scanRound;	//The round scanLeft is for
+	int scanning;		//Goes on looking for jobs for its filter in the next round
+	int ranged;		//The current request is a GETRANGE
+	size_t rangeNext;	//Next job of it, numbered through all shards
+	int starved;		//Waits for the shards to grow, with -f, or for another thread
+	int moving;		//Is handed to the next thread at the end of the round
+	int hops;		//Threads it was handed over by since its last job
+	struct client *next;
+};
+
+struct request {
+	int (*execute)(struct client *c, char *msg);	//NULL for an unknown request
+	size_t length[PROTOCOLVERSION + 1];		//With the version of the client, 0 before a HELLO, 
+							//0 if it isn't in that version
+	int framed;		//A 32 bit length of the rest follows the first byte
+};
 
 char *filename;
-int welcomeSocket, newSocket, fp;
-struct sockaddr_storage serverStorage;
+__thread int welcomeSocket, epollFd;
+__thread struct sockaddr_storage serverStorage;
+__thread struct client *clients;
+__thread struct client *closedClients;
+char *localPath;
+__thread int localSocket = -1;
+__thread struct jobFile **shards;
+__thread int shardCount, shardCap, shardTurn;
+__thread char *shardDir;
+__thread int inotifyFd = -1;
+char emptyFileMsg[2] = {EMPTYFILE, 0};
+char emptyFileMsgV2[V2HEADER] = {EMPTYFILE, 0, 0, 0, 0};
+int wantRing, zeroCopy, resume, follow;
+__thread int useRing, fixedFiles;
+__thread struct timespec lastCheckpoint;
+volatile sig_atomic_t statsWanted, stopWanted;	//statsWanted counts the SIGUSR1s
+volatile sig_atomic_t mappingsLost;	//Counts the reads of shards past their end, with -f
+__thread sig_atomic_t statsSeen;
+__thread struct ring ring;
+__thread char *ringBuffers;
+__thread int freeBuffers[RINGBUFFERS], freeBufferCount;
+int serverThreads = 1;
+__thread int threadNr;
+struct request requests[256];	//By the first byte, filled in before any thread starts
+int *wakeFds;		//eventfd of every thread, NULL with one thread
+
+/*Clients that are handed over to a thread, taken by it when its eventfd is written.*/
+struct inbox {
+	pthread_mutex_t lock;
+	struct client *first;
+};
+
+struct inbox *inboxes;	//Inbox of every thread, NULL with one thread
+struct jobFile **sharedFiles;	//Job files the threads share, opened once for all of them
+int sharedCount, sharedCap;
+pthread_mutex_t sharedLock = PTHREAD_MUTEX_INITIALIZER;
+__thread int movingCount;
+__thread int scanningCount;
+__thread uint64_t rounds;	//Rounds of the event loop
+cpu_set_t cpus;
 
+int parseOptions(int argc, char *argv[]);
+void registerRequests();
+void registerRequest(char type, int (*execute)(struct client *c, char *msg), size_t lengthV1, size_t lengthV2, int framed);
+int serve();
+int serveThreads();
+void * serverThread(void *arg);
 int bindAndListen();
-int acceptConnection();
-int openFile();
-int executeJob();
-int getJob(int numJobs);
-int sendTerminationMsgToClient();
-int readFile(int newSocket, int fp);
-int msgInterp(char msg);
+int listenLocal();
+int setNonBlocking(int sock);
+int eventLoop();
+int acceptConnection(int listener, int local);
+struct client * newClient(int sock, int local);
+void closeClient(struct client *c);
+void returnJobs(struct client *c);
+int outputLost(struct client *c);
+int watchClient(struct client *c);
+int clientReadable(struct client *c);
+int flushClient(struct client *c);
+int appendToClient(struct client *c, char *msg, size_t length);
+int openFile(int (*add)(char *path));
+int addShard(char *path);
+int openShared(char *path);
+struct jobFile * sharedFile(char *path);
+void printShard(struct jobFile *jf);
+int isShardName(char *name);
+void shardsChanged(int feed);
+int watchShard(struct jobFile *jf);
+int growShard(struct jobFile *jf);
+void feedStarved();
+void feedScanning();
+int shardHasTypes(struct client *c, struct jobFile *jf);
+struct jobFile * nextShard(int take);
+int executeJob(struct client *c);
+int jobRequest(struct client *c, char *msg);
+int endRequest(struct client *c, char *msg);
+int filterRequest(struct client *c, char *msg);
+int rangeRequest(struct client *c, char *msg);
+struct jobFile * shardOfJob(size_t *job);
+size_t jobAtOffset(uint64_t offset);
+uint32_t indexedJobs(size_t first, size_t end);
+int helloFromClient(struct client *c, char *msg);
+int startLink(struct client *c);
+int getJob(struct client *c, uint32_t numJobs);
+int fillBatch(struct client *c);
+int fillJobs(struct client *c);
+int fillRange(struct client *c);
+struct jobFile * filteredShard(struct client *c);
+size_t peekJob(struct client *c, struct jobFile *jf);
+void packBatch(struct client *c);
+size_t packJobs(struct client *c, int from, int to, char *out, size_t limit);
+int sendTerminationMsgToClient(struct client *c);
+int readFile(struct client *c);
+int appendJob(struct client *c, char *record, size_t length);
+int initRing();
+int submitToRing(struct client *c);
+int submitWrite(struct client *c);
+void reapRing();
+int ringCompletion(struct client *c, int tag, int res);
+void releaseBuffer(struct client *c);
+int batchSent(struct client *c);
+int checkpoint(int now);
+void batchDelivered(struct client *c);
+void statsSignal(int signo);
+void mappingLost(int signo, siginfo_t *info, void *context);
+void stopServer();
+void handOver();
+int adoptClients();
 
 /*This is the main method wich first calls checkArguments and init_sig_handler and
-*exits due to failure if any of these functions are == -1. Then the sockets are created, 
-*and as soon as a connection is found, the socket that listens for connections are closed. 
-*Then the functions executeJob is called, and when that returns the program is terminated.
+*exits due to failure if any of these functions are == -1. Then serve is called, or
+*serveThreads with more than one thread. The event loop only returns on an error, 
+*otherwise the server runs until it is stopped by (ctrl+c).
 *
 *Input: 
 *	a: number of arguments
@@ -55,24 +434,173 @@ int msgInterp(char msg);
 */
 int main(int argc, char *argv[]) {
 	
-	if ((checkArguments(argc, argv[1], argv[2]) + init_sig_handler()) != 0) exit(EXIT_FAILURE);
-
-	/*Initialize socket and connections*/
-	if ((welcomeSocket = createSocket(NULL, port)) == -1) terminator(ERRORTERMINATE);
-	if (bindAndListen() == -1) terminator(ERRORTERMINATE);
-	if (acceptConnection() == -1) terminator(ERRORTERMINATE);
-	close(welcomeSocket);
-
-	socketConnection = CONNECTED;
+	if (parseOptions(argc, argv) == -1) exit(EXIT_FAILURE);
+	int rest = argc - optind;
+	if ((checkArguments(rest + 1, rest > 0 ? argv[optind] : NULL, rest > 1 ? argv[optind+1] : NULL) + init_sig_handler()) != 0) exit(EXIT_FAILURE);
+	signal(SIGPIPE, SIG_IGN); //Dead clients are noticed through write() instead
+	signal(SIGUSR1, statsSignal);
+	if (follow) {
+		struct sigaction sa = {.sa_sigaction = mappingLost, .sa_flags = SA_SIGINFO};
+		sigaction(SIGBUS, &sa, NULL);
+	}
+	metricsNow();
+	registerRequests();
+	if (serverThreads > 1) exit(serveThreads());
 
-	/*Execute clients requests*/
-	if (executeJob() == -1) terminator(ERRORTERMINATE);
+	/*Serve clients until stopped*/
+	if (serve() == -1) terminator(ERRORTERMINATE);
 
 	/*Finished*/
 	terminator(NORMALTERMINATE);
 	return 0;
 }
 
+/*This function fills in the table of requests the server understands.
+*
+*Input: none
+*
+*Return: none
+*/
+void registerRequests() {
+
+	registerRequest(GETJOB, jobRequest, 2, 5, 0);
+	registerRequest(HELLO, helloFromClient, HELLOLENGTH, HELLOLENGTH, 0);
+	registerRequest(NORMALTERMINATE, endRequest, 1, 1, 0);
+	registerRequest(ERRORTERMINATE, endRequest, 1, 1, 0);
+	registerRequest(FILTER, filterRequest, 0, V2HEADER, 1);
+	registerRequest(GETRANGE, rangeRequest, 0, RANGELENGTH, 0);
+}
+
+/*This function adds a request to the table. The length before a HELLO is the length in
+*version 1, since the request makes the client a version 1 client. A framed request is
+*as long as the length after its first byte says, plus V2HEADER.
+*
+*Input: 
+*	a: first byte of the request
+*	b: function that executes it
+*	c: length of the request in version 1, 0 if it isn't in version 1
+*	d: length of the request in version 2, V2HEADER if it is framed
+*	e: 1 if it is framed
+*
+*Return: none
+*/
+void registerRequest(char type, int (*execute)(struct client *c, char *msg), size_t lengthV1, size_t lengthV2, int framed) {
+
+	struct request *r = &requests[(unsigned char) type];
+	r->execute = execute;
+	r->length[0] = r->length[1] = lengthV1;
+	r->length[2] = lengthV2;
+	r->framed = framed;
+}
+
+/*This function sets up one event loop: the listening socket is created, the job file is
+*opened and the ring is set up, and then eventLoop is entered. With several threads every
+*thread calls it, and gets its own of all of them.
+*
+*Input: none
+*
+*Return: 
+*0 when the server is stopped, -1 for error
+*/
+int serve() {
+
+	/*Initialize socket and job file*/
+	useRing = wantRing;
+	if ((welcomeSocket = createSocket(NULL, port)) == -1) return -1;
+	if (bindAndListen() == -1) return -1;
+	if (localPath != NULL && listenLocal() == -1) return -1;
+	if (openFile(addShard) == -1) return -1;
+	if (useRing && initRing() == -1) {
+		if (threadNr == 0) printf("io_uring isn't available, using writev() instead\n");
+		useRing = 0;
+	}
+
+	socketConnection = CONNECTED;
+	return eventLoop();
+}
+
+/*This function runs the server with one thread per core. SIGINT and SIGUSR1 are blocked
+*before the threads are started, so they are only taken here, by sigwait(). On SIGUSR1 
+*every thread is woken to write its metrics, and on SIGINT every thread is woken to stop,
+*and waited for. If a thread can't be started an error message is printed.
+*
+*Input: none
+*
+*Return: 
+*EXIT_SUCCESS, or EXIT_FAILURE for error
+*/
+int serveThreads() {
+
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	/*The job files are mapped and indexed once, here, and every thread shares them*/
+	if (openFile(openShared) == -1) return EXIT_FAILURE;
+	if (inotifyFd != -1) close(inotifyFd);
+
+	pthread_t threads[serverThreads];
+	if ((wakeFds = malloc(serverThreads * sizeof(int))) == NULL || 
+			(inboxes = calloc(serverThreads, sizeof(struct inbox))) == NULL) {
+		perror("malloc()");
+		return EXIT_FAILURE;
+	}
+	for (int t = 0; t < serverThreads; t++) {
+		pthread_mutex_init(&inboxes[t].lock, NULL);
+		if ((wakeFds[t] = eventfd(0, EFD_NONBLOCK)) == -1) {
+			perror("eventfd()");
+			return EXIT_FAILURE;
+		}
+		if ((errno = pthread_create(&threads[t], NULL, serverThread, (void *)(intptr_t) t)) != 0) {
+			perror("pthread_create()");
+			return EXIT_FAILURE;
+		}
+	}
+
+	while (!stopWanted) {
+		int sig;
+		if (sigwait(&set, &sig) != 0) continue;
+		if (sig == SIGUSR1) statsWanted++;
+		else stopWanted = 1;
+
+		uint64_t one = 1;
+		for (int t = 0; t < serverThreads; t++) write(wakeFds[t], &one, sizeof(one));
+	}
+	for (int t = 0; t < serverThreads; t++) pthread_join(threads[t], NULL);
+	for (int s = 0; s < sharedCount; s++) jobFileClose(sharedFiles[s]);
+	return EXIT_SUCCESS;
+}
+
+/*This function is run by every server thread. The thread is pinned to a core of its
+*own, as far as there are cores, and serves until it is stopped. On an error the whole
+*server terminates.
+*
+*Input: 
+*	a: number of the thread
+*
+*Return: 
+*NULL
+*/
+void * serverThread(void *arg) {
+
+	threadNr = (intptr_t) arg;
+	int n = threadNr % CPU_COUNT(&cpus);
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &cpus) || n-- > 0) continue;
+		cpu_set_t one;
+		CPU_ZERO(&one);
+		CPU_SET(cpu, &one);
+		if ((errno = pthread_setaffinity_np(pthread_self(), sizeof(one), &one)) != 0) perror("pthread_setaffinity_np()");
+		break;
+	}
+
+	if (serve() == -1) terminator(ERRORTERMINATE);
+	stopServer();
+	return NULL;
+}
+
 /*This function checks that the user provided the correct argument size
 *and if not prints a message infroming of correct use. -1 (error) is returned.
 *
@@ -92,7 +620,7 @@ int main(int argc, char *argv[]) {
 int checkArguments(int argc, char *h, char *p) {
 
 	if (argc != 3) {
-		printf("Correct usage: ./server <filename> <port>\n");
+		printf("Correct usage: ./server [-u | -z] [-r | -t <threads>] [-l <socket>] [-f] <filename | directory | 'pattern'> <port>\n");
 		return -1;
 	}
 
@@ -105,8 +633,65 @@ int checkArguments(int argc, char *h, char *p) {
 	return 0;
 }
 
+/*This function reads the options given before the filename and port.
+*-u sends the batches through io_uring and -z sends them with sendfile().
+*-r resumes from the state file, and -t runs one event loop per thread,
+*where 0 threads is one for every core the server may run on. -l listens
+*on a Unix socket as well.
+*If an option is unknown or they are combined -1 (error) is returned.
+*
+*Input: 
+*	a: number of arguments
+*	b: arguments
+*
+*Return: 
+*0 for success, -1 for error
+*/
+int parseOptions(int argc, char *argv[]) {
+
+	int opt;
+	while ((opt = getopt(argc, argv, "uzrft:l:")) != -1) {
+		if (opt == 'u') wantRing = 1;
+		else if (opt == 'z') zeroCopy = 1;
+		else if (opt == 'r') resume = 1;
+		else if (opt == 'f') follow = 1;
+		else if (opt == 't') serverThreads = atoi(optarg);
+		else if (opt == 'l') localPath = optarg;
+		else return -1;
+	}
+	if (wantRing && zeroCopy) {
+		printf("-u and -z can't be combined\n");
+		return -1;
+	}
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) == -1) {
+		perror("sched_getaffinity()");
+		return -1;
+	}
+	if (serverThreads == 0) serverThreads = CPU_COUNT(&cpus);
+	if (serverThreads < 1 || serverThreads > CPU_SETSIZE) {
+		printf("The number of threads has to be between 0 and %d\n", CPU_SETSIZE);
+		return -1;
+	}
+	if (resume && serverThreads > 1) {
+		printf("-r and -t can't be combined\n");
+		return -1;
+	}
+	if (localPath != NULL && serverThreads > 1) {
+		printf("-l and -t can't be combined\n");
+		return -1;
+	}
+	if (follow && serverThreads > 1) {
+		printf("-f and -t can't be combined\n");
+		return -1;
+	}
+	return 0;
+}
+
 /*This function binds the socket and listens for attempts at connecting, if any
 *of those functions fail an error message is printed and -1 (error) is returned.
+*The listening socket is made non-blocking so that the event loop can accept
+*every pending connection without ever blocking. With several threads the port
+*is shared with SO_REUSEPORT.
 *
 *Input: none
 *
@@ -115,205 +700,2156 @@ int checkArguments(int argc, char *h, char *p) {
 */
 int bindAndListen() {
 
+	int on = 1;
+	setsockopt(welcomeSocket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (serverThreads > 1 && setsockopt(welcomeSocket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+		perror("setsockopt()");
+		return -1;
+	}
+
 	if ((bind(welcomeSocket, (struct sockaddr *) &serverAddr, sizeof(serverAddr))) == -1) {
 		perror("bind()");
 		return -1;
 	}
 
-	if (listen(welcomeSocket, 5) == 0) printf("Listening\n");
-	else {
+	if (listen(welcomeSocket, SOMAXCONN) == 0) {
+		if (serverThreads > 1 && threadNr == 0) printf("Listening with %d threads\n", serverThreads);
+		else if (serverThreads == 1) printf("Listening\n");
+	} else {
 		perror("listen()");
 		return -1;
 	}
-	return 0;
+	return setNonBlocking(welcomeSocket);
 }
 
-/*This function accepts connections from client and prints a message if there is an error
+/*This function creates the Unix socket for clients on the same host, binds it to its
+*path, wich is removed first if an old server left it, and listens on it like on the
+*port. If any of it fails an error message is printed.
 *
 *Input: none
 *
 *Return: 
 *0 for successfull execution, -1 for error
 */
-int acceptConnection() {
+int listenLocal() {
+
+	struct sockaddr_un addr;
+	if ((localSocket = createLocalSocket(localPath, &addr)) == -1) return -1;
+	unlink(localPath);
+	if (bind(localSocket, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		perror("bind()");
+		return -1;
+	}
+	if (listen(localSocket, SOMAXCONN) == -1) {
+		perror("listen()");
+		return -1;
+	}
+	printf("Listening on %s\n", localPath);
+	return setNonBlocking(localSocket);
+}
+
+/*This function sets the O_NONBLOCK flag on a socket.
+*
+*Input: 
+*	a: socket
+*
+*Return: 
+*0 for successfull execution, -1 for error
+*/
+int setNonBlocking(int sock) {
 
-	addr_size = sizeof serverStorage;
-	if ((newSocket = accept(welcomeSocket, (struct sockaddr *) &serverStorage, &addr_size)) == -1) {
-		perror("accept()");	
+	int flags = fcntl(sock, F_GETFL, 0);
+	if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+		perror("fcntl()");
 		return -1;
 	}
-	printf("\n---Connection established!---\n\n");
 	return 0;
 }
 
-/*This function first opens the file given in the arguments at runtime. Then a byte is read
-*from the client and the meaning of that byte is sent as an argument to msgInterp. The return-
-*value from that function is used to decide weather the user asks for a job or terminated. 
-*If the client terminated normally 0 is returned, if it was due to an error -1 is returned. 
-*If the client asks for a job then another byte is read, wich is the number of jobs
-*the user wants (numJobs). Then getJob is called with numJobs as argument. If that returns -1
-*that means that there was an error and -1 is returned if 1 is returned that means that the
-*end-of-file is reached, and 0 is returned.
+/*This function creates the epoll instance, registers the listening socket and then
+*waits for events forever. New connections are accepted, readable clients get their
+*requests executed and writable clients get their pending output flushed. A client
+*that fails in any of these steps is closed without affecting the others. With io_uring
+*the ring is registered as well, and is readable when requests have completed. What was
+*prepared for the ring during one round is submitted at the end of it. With several
+*threads the eventfd of the thread is registered too, and the main thread uses it to
+*ask for the metrics or to stop the loop. So is the Unix socket, and the spaceFd of
+*every client with a shared memory ring, whose events are marked with SPACETAG. A 
+*client that is closed during a round is only freed at the end of it, since another 
+*event of the round may point to it.
 *
 *Input: none
 *
 *Return: 
-*0 for success, -1 for error
+*0 when the thread is stopped, -1 for error
 */
-int executeJob() {
-	
-	char clientMsg[1];	
-	if (openFile() == -1) return -1;
+int eventLoop() {
+
+	struct epoll_event ev, events[MAXEVENTS];
+
+	if ((epollFd = epoll_create1(0)) == -1) {
+		perror("epoll_create1()");
+		return -1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL; //NULL marks the listening socket
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, welcomeSocket, &ev) == -1) {
+		perror("epoll_ctl()");
+		return -1;
+	}
+	ev.data.ptr = &ring;
+	if (useRing && epoll_ctl(epollFd, EPOLL_CTL_ADD, ring.fd, &ev) == -1) {
+		perror("epoll_ctl()");
+		return -1;
+	}
+	ev.data.ptr = &inotifyFd;
+	if (inotifyFd != -1 && epoll_ctl(epollFd, EPOLL_CTL_ADD, inotifyFd, &ev) == -1) {
+		perror("epoll_ctl()");
+		return -1;
+	}
+	ev.data.ptr = &wakeFds;
+	if (wakeFds != NULL && epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFds[threadNr], &ev) == -1) {
+		perror("epoll_ctl()");
+		return -1;
+	}
+	ev.data.ptr = &localSocket;
+	if (localSocket != -1 && epoll_ctl(epollFd, EPOLL_CTL_ADD, localSocket, &ev) == -1) {
+		perror("epoll_ctl()");
+		return -1;
+	}
+
+	for (;;) {
+
+		if (stopWanted) return 0;
+		if (statsSeen != statsWanted) {
+			statsSeen = statsWanted;
+			metricsDump(stderr, wakeFds != NULL ? threadNr : -1);
+		}
+		int n = epoll_wait(epollFd, events, MAXEVENTS, scanningCount > 0 ? 0 : resume ? CHECKPOINTMS : -1);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			perror("epoll_wait()");
+			return -1;
+		}
+
+		for (int i = 0; i < n; i++) {
+
+			struct client *c = events[i].data.ptr;
+			if (c == NULL) {
+				if (acceptConnection(welcomeSocket, 0) == -1) return -1;
+				continue;
+			}
+			if (events[i].data.ptr == &localSocket) {
+				if (acceptConnection(localSocket, 1) == -1) return -1;
+				continue;
+			}
+			if (events[i].data.ptr == &ring) {
+				reapRing();
+				continue;
+			}
+			if (events[i].data.ptr == &inotifyFd) {
+				shardsChanged(1);
+				continue;
+			}
+			if (events[i].data.ptr == &wakeFds) {
+				uint64_t count;
+				read(wakeFds[threadNr], &count, sizeof(count));
+				if (adoptClients() == -1) return -1;
+				continue;
+			}
+			if ((uintptr_t) c & SPACETAG) { //The klient made room in the ring
+				c = (struct client *) ((uintptr_t) c & ~(uintptr_t) SPACETAG);
+				if (c->closed) continue;
+				uint64_t count;
+				read(c->link.spaceFd, &count, sizeof(count));
+				if (c->iovPos < c->iovCount && flushClient(c) != 0) closeClient(c);
+				continue;
+			}
+			if (c->closed) continue;
+
+			testValue = 0;
+			if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) testValue = -1;
+			if (testValue == 0 && (events[i].events & EPOLLOUT)) testValue = flushClient(c);
+			if (testValue == 0 && (events[i].events & EPOLLIN)) testValue = clientReadable(c);
+			if (testValue != 0) closeClient(c);
+		}
+		if (useRing && ringSubmit(&ring) == -1) return -1;
+		if (resume && checkpoint(0) == -1) return -1;
+		if (movingCount > 0) handOver();
+		rounds++;
+		if (scanningCount > 0) feedScanning();
+
+		while (closedClients != NULL) {
+			struct client *c = closedClients;
+			closedClients = c->next;
+			free(c);
+		}
+	}
+}
+
+/*This function accepts every pending connection from clients and prints a message 
+*if there is an error. A connection that is aborted before it is accepted is not
+*treated as an error.
+*
+*Input: 
+*	a: listening socket
+*	b: 1 for the Unix socket
+*
+*Return: 
+*0 for successfull execution, -1 for error
+*/
+int acceptConnection(int listener, int local) {
+
+	for (;;) {
+
+		addr_size = sizeof serverStorage;
+		int sock = accept(listener, (struct sockaddr *) &serverStorage, &addr_size);
+		if (sock == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) return 0;
+			if (errno == EMFILE || errno == ENFILE) {
+				perror("accept()"); //Out of descriptors, try again on next event
+				return 0;
+			}
+			perror("accept()");	
+			return -1;
+		}
+		if (newClient(sock, local) == NULL) close(sock);
+		else {
+			stats.accepted++;
+			printf("\n---Connection established!---\n\n");
+		}
+	}
+}
+
+/*This function allocates the state of a new client, makes its socket non-blocking 
+*with TCP_NODELAY and registers it in the epoll instance. 
+*
+*Input: 
+*	a: socket connected to the client
+*	b: 1 if it came through the Unix socket
+*
+*Return: 
+*the new client, NULL for error
+*/
+struct client * newClient(int sock, int local) {
+
+	struct client *c = calloc(1, sizeof(struct client));
+	if (c == NULL) {
+		perror("calloc()");
+		return NULL;
+	}
+	c->sock = sock;
+	c->buffer = -1;
+	c->local = local;
+	c->link.memFd = c->link.dataFd = c->link.spaceFd = -1;
+	int on = 1;
+	if (!local) setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	/*io_uring waits for room in the socket by itself, so only writev() needs non-blocking*/
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if (!useRing && setNonBlocking(sock) == -1) {
+		free(c);
+		return NULL;
+	}
+	if (fixedFiles && (sock >= MAXFIXEDFILES || ringUpdateFile(&ring, sock, sock) == -1)) {
+		free(c);
+		return NULL;
+	}
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+		perror("epoll_ctl()");
+		free(c);
+		return NULL;
+	}
+
+	c->next = clients;
+	clients = c;
+	return c;
+}
+
+/*This function removes a client from the list of clients, closes its socket and frees
+*its state. A client that still has io_uring requests in flight is only taken out of the
+*epoll instance, and closed for real when the last of them completes, since the kernel
+*may still be using its buffer and socket. The jobs of its batch that weren't sent are 
+*given back first.
+*
+*Input: 
+*	a: client to be closed
+*
+*Return: none
+*/
+void closeClient(struct client *c) {
 
-	for(;;) {	
+	if (c->inflight > 0) {
+		if (!c->closing) epoll_ctl(epollFd, EPOLL_CTL_DEL, c->sock, NULL);
+		c->closing = 1;
+		return;
+	}
+	if (fixedFiles) ringUpdateFile(&ring, c->sock, -1);
+	returnJobs(c);
+	releaseBuffer(c);
+	if (c->moving) movingCount--;
+	if (c->scanning) scanningCount--;
 
-		/*Read first msg from client*/
-		if (readFromFileDescriptor(newSocket, clientMsg, sizeof(clientMsg)) == -1) return -1;
-		testValue = msgInterp(clientMsg[0]);
+	for (struct client **p = &clients; *p != NULL; p = &(*p)->next) {
+		if (*p == c) {
+			*p = c->next;
+			break;
+		}
+	}
+	close(c->sock); //Closing also removes the socket from the epoll instance
+	shmClose(&c->link);
+	stats.closed++;
+	if (c->features & FEATURECOMPRESS) deflateEnd(&c->zs);
+	free(c->iov);
+	free(c->headers);
+	free(c->packed);
+	free(c->filter);
+	free(c->scan);
+	free(c->batchJobs);
+	c->closed = 1;
+	c->next = closedClients;
+	closedClients = c;
+	printf("\n---Connection closed!---\n\n");
+}
 
-		if (testValue == 0) { //Client asks for job
+/*This function gives the jobs of the open batch of a client that is closed back to the
+*shard they were taken from, from the first one that wasn't sent on, so another client
+*takes them and the checkpoint doesn't move past them. A job is sent when all of its 
+*output is written, with io_uring when the write of the buffer it was copied into is 
+*complete. The other clients whose filter has looked past a job that is given back look
+*at it again. A shard that got smaller keeps them.
+*
+*Input: 
+*	a: client
+*
+*Return: none
+*/
+void returnJobs(struct client *c) {
 
-			if (readFromFileDescriptor(newSocket, clientMsg, sizeof(clientMsg)) == -1) return -1;
+	struct jobFile *jf = c->batchShard;
+	if (!c->batchOpen || c->ranged || jf == NULL || jf->shrunk) return;
+	int unsent = useRing && c->link.h == NULL && c->sent < c->sendLen ? c->sendPos : c->iovPos;
+	int s = 0;
+	while (s < shardCount && shards[s] != jf) s++;
 
-			testValue = getJob((int)((unsigned char)clientMsg[0]));
-			if (testValue == -1) return -1; //Error when reading file
-			else if (testValue == 1) return 0; //No more jobs to read
+	for (int i = 0; i < c->batchJobCount; i++) {
+		size_t job = c->batchJobs[i].job;
+		if (c->batchJobs[i].end <= unsent) continue;
+		if (jobFileReturn(jf, job) == -1) return;
+		for (struct client *o = clients; o != NULL; o = o->next) {
+			if (o != c && s < o->scanCap && o->scan[s] > job) o->scan[s] = job;
 		}
-		else if (testValue == -2) return -1; //Client terminated due to an error/ or didn't understand msg
-		else break; //Client terminater normally
 	}
+	c->batchJobCount = 0;
+}
+
+/*This function tells if the pending output of a client points into the shard of its 
+*batch past the end of the file, after the file got smaller. That part of the mapping 
+*can't be sent, since it reads zeros or raises SIGBUS.
+*
+*Input: 
+*	a: client
+*
+*Return: 
+*1 if it does, 0 if not
+*/
+int outputLost(struct client *c) {
 
-	close(fp);
+	struct jobFile *jf = c->batchShard;
+	struct stat st;
+	if (jf == NULL || !jf->shrunk) return 0;
+	if (fstat(jf->fd, &st) == -1) return 1;
+	for (int i = c->iovPos; i < c->iovCount; i++) {
+		char *base = c->iov[i].iov_base;
+		if (jobFileContains(jf, base) && base + c->iov[i].iov_len > jf->map + st.st_size) {
+			printf("%s got smaller while it was sent\n", jf->name);
+			return 1;
+		}
+	}
 	return 0;
 }
 
-/*This function takes an argument numJobs and makes a for loop that loops
-*numJobs times, or is broken by an error or end of file. In the loop readFile
-*is called and if that returns -1 that means that there is an error and -1 is
-*returned, if not 0 is always returned. Even if readFile returns 1 wich 
-*indicates end-of-file.
+/*This function tells epoll what to wait for on a client. A client with pending output
+*only waits for its socket to become writable, so that its next request isn't read 
+*before the previous one is sent. With io_uring it waits for nothing in the meantime, 
+*since the ring tells when the output is sent. A client with a shared memory ring waits
+*for its spaceFd instead of its socket. A client that waits for the shards to grow still
+*has a request open, so it only waits for the connection to be closed. Otherwise it waits
+*for new requests.
 *
 *Input: 
-*	a: number of jobs to read from file
+*	a: client
 *
 *Return: 
-*0 on success, -1 for error
+*0 for success, -1 for error
 */
-int getJob(int numJobs) {
-		
-	for (int i = 0; i < numJobs && testValue != 1; i++) {
-		testValue = readFile(newSocket, fp);
-		if (testValue == -1) return -1;
+int watchClient(struct client *c) {
+
+	struct epoll_event ev;
+	int pending = c->iovPos < c->iovCount;
+	ev.events = EPOLLIN;
+	if (pending) ev.events = (useRing || c->link.h != NULL) ? 0 : EPOLLOUT;
+	else if (c->starved) ev.events = EPOLLRDHUP;
+	ev.data.ptr = c;
+	if (epoll_ctl(epollFd, EPOLL_CTL_MOD, c->sock, &ev) == -1) {
+		perror("epoll_ctl()");
+		return -1;
+	}
+
+	if (c->link.h != NULL && pending != c->spaceWatched) {
+		ev.events = pending ? EPOLLIN : 0;
+		ev.data.ptr = (char *) c + SPACETAG;
+		if (epoll_ctl(epollFd, EPOLL_CTL_MOD, c->link.spaceFd, &ev) == -1) {
+			perror("epoll_ctl()");
+			return -1;
+		}
+		c->spaceWatched = pending;
 	}
 	return 0;
 }
 
-/*This function opens a file with a filename given by user. 
-*If the open() function fails, then an error message is printed.
+/*This function reads whatever the client has sent and executes the complete requests
+*in the input buffer. A half received request stays in the buffer until the rest of it
+*arrives.
 *
-*Input: none
+*Input: 
+*	a: client
 *
 *Return: 
-*A file pointer on success, -1 for error
+*0 for success, 1 if the client terminated, -1 for error
 */
-int openFile() {
+int clientReadable(struct client *c) {
 
-	fp = open(filename, O_RDONLY);
-	if (fp == -1) perror("open()");
-	return fp;
+	ssize_t n = recv(c->sock, c->in + c->inLen, sizeof(c->in) - c->inLen, MSG_DONTWAIT);
+	if (n <= 0) {
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+		if (n == -1) perror("recv()");
+		return -1;
+	}
+	c->inLen += n;
+	return executeJob(c);
 }
 
-/*This function starts with reading two bytes from the file and checking for errors in an 
-*if-test. If there are errors sendTerminationMsgToClient is called, wich indicates that 
-*the file is empty/finished. If not then another 'textLength' number of bytes is read from 
-*the file. Then jobtype, textlength and jobtext is written to client.
+/*This function writes as much of the pending output of a client as the socket accepts.
+*The whole batch is handed to writev() at once, in chunks of at most IOV_MAX entries. A
+*partially written entry is moved forward so the next call continues where this one
+*stopped. When all of it is written any requests that arrived in the meantime are 
+*executed. With io_uring the output is handed to submitToRing instead. A client with a
+*shared memory ring gets the entries copied into the ring by shmWritev. In zero-copy 
+*mode an entry that points into the mapped job file is sent with sendfile() from the 
+*file itself, and writev() only gets the entries between them. A sendfile() that sends
+*nothing means the file was truncated under the mapping, and closes the client. As long
+*as the current request has jobs left, the next batch is made and written as soon as 
+*one is done, unless the client has to wait for the shards to grow.
 *
-*Input:
-*	a: socket to communicate with client
-*	b: file to read from
+*Input: 
+*	a: client
 *
 *Return: 
-0 successful execution, 1 for end of file, -1 for error
+*0 for success, 1 if the client terminated, -1 for error
 */
-int readFile(int newSocket, int fp) {
+int flushClient(struct client *c) {
+
+	if (outputLost(c)) return -1;
+	if (useRing && c->link.h == NULL) return submitToRing(c);
 
-	char buffer[2];	
-	testValue = readFromFileDescriptor(fp, buffer, sizeof(buffer));
-	int textLength = (int)((unsigned char) buffer[1]);
+	while (c->iovPos < c->iovCount || (c->remaining > 0 && !c->starved)) {
 
-	if (testValue != -1 && textLength > 0) { //Send job to client
+		if (c->iovPos == c->iovCount) {
+			c->iovPos = c->iovCount = 0;
+			c->headersLen = c->packedLen = 0;
+			c->run = NULL;
+			batchDelivered(c);
+			if (fillBatch(c) == -1) return -1;
+			continue;
+		}
 
-		/*Read jobtext*/
-		char jobText[textLength+2];
-		if (readFromFileDescriptor(fp, jobText+2, textLength) == -1) return -1;
+		ssize_t n;
+		struct iovec *v = &c->iov[c->iovPos];
+		uint64_t start = metricsNow();
 
-		jobText[0] = buffer[0];
-		jobText[1] = textLength;
+		if (c->link.h != NULL) {
 
-		/*Writing jobtype, textlength and jobtext to client*/
-		if (writeToFileDescriptor(newSocket, jobText, textLength+2) == -1) return -1;
+			sig_atomic_t lost = mappingsLost;
+			n = shmWritev(&c->link, v, c->iovCount - c->iovPos);
+			stats.shmWrites++;
+			if (mappingsLost != lost) return -1; //The ring may have zeros from past the end
 
-	} else { //Inform client that there are no jobs left	
+		} else if (zeroCopy && v->iov_len >= SENDFILEMIN && jobFileContains(c->batchShard, v->iov_base)) {
 
-		if (sendTerminationMsgToClient() == -1) return -1;
-		return 1;
+			off_t offset = (char *) v->iov_base - c->batchShard->map;
+			n = sendfile(c->sock, c->batchShard->fd, &offset, v->iov_len);
+			stats.sendfiles++;
+			if (n == 0) { //The file is shorter than the mapping, nothing would ever be sent
+				printf("%s was truncated while it was sent\n", c->batchShard->name);
+				return -1;
+			}
+
+		} else {
+
+			int count = 0;
+			while (c->iovPos + count < c->iovCount && count < IOV_MAX) {
+				struct iovec *next = &c->iov[c->iovPos + count];
+				if (zeroCopy && next->iov_len >= SENDFILEMIN && jobFileContains(c->batchShard, next->iov_base)) break;
+				count++;
+			}
+			n = writev(c->sock, v, count);
+			stats.writes++;
+		}
+		histogramAdd(&stats.writeCall, metricsNow() - start);
+
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				stats.blocked++;
+				return watchClient(c);
+			}
+			perror(c->link.h != NULL ? "shmWritev()" : zeroCopy ? "sendfile()/writev()" : "writev()");
+			return -1;
+		}
+		stats.bytes += n;
+
+		while (n > 0 && (size_t)n >= c->iov[c->iovPos].iov_len) n -= c->iov[c->iovPos++].iov_len;
+		if (n > 0) {
+			c->iov[c->iovPos].iov_base = (char *) c->iov[c->iovPos].iov_base + n;
+			c->iov[c->iovPos].iov_len -= n;
+		}
 	}
-	return 0;	
+	return batchSent(c);
 }
 
-/*This function sends a message to client with 'Q' and the number 0. Wich
-*will make the client terminate. 
+/*This function is called when all the output of a client is written. If the current 
+*request has jobs left the next batch is made and sent, unless the client waits for the
+*shards to grow. Otherwise any requests that arrived in the meantime are executed, or 
+*the client waits for new ones.
 *
-*Input: none
+*Input: 
+*	a: client
 *
-*Return:
-*0 for success, -1 for error
+*Return: 
+*0 for success, 1 if the client terminated, -1 for error
 */
-int sendTerminationMsgToClient() {
+int batchSent(struct client *c) {
 
-	char buffer[2];
-	buffer[0] = EMPTYFILE;
-	buffer[1] = 0;
-	return writeToFileDescriptor(newSocket, buffer, sizeof(buffer));
+	c->iovPos = c->iovCount = 0;
+	c->headersLen = c->packedLen = 0;
+	c->run = NULL;
+	batchDelivered(c);
+	if (c->remaining > 0 && !c->starved) {
+		if (fillBatch(c) == -1) return -1;
+		return flushClient(c);
+	}
+	if (c->inLen > 0) return executeJob(c);
+	return watchClient(c);
 }
 
-/*This function compares the message given as an argument to know messages from the client.
-*If the message doesn't compare to any of the known message then -2 is returned. Otherwise
-*the corresponding number to the message that the argument compares to is returned (*-1). 
-*That means that -2 can also be returned by the message being an ERRORTERMINATE message.
+/*This function is called when the batch of a client is written, and counts how long it
+*took since it was made.
 *
-*Input:
-*	a: the message to be interpreted
+*Input: 
+*	a: client
 *
-*Return:
-*0 for successfull execution, -1 for normal error, and -2 for fatal error
+*Return: none
 */
-int msgInterp(char msg) {
+void batchDelivered(struct client *c) {
 
-	char messages[3] = {GETJOB, NORMALTERMINATE, ERRORTERMINATE};
+	if (c->batchOpen) histogramAdd(&stats.batchTotal, metricsNow() - c->batchMade);
+	c->batchOpen = 0;
+}
 
-	for (int i = 0; i < (int)(sizeof(messages)/sizeof(messages[0])); i++) {
-		if (msg == messages[i]) return (-1*i);
-	}
-	return -2;
+/*This function only notes that the metrics are wanted, they are written by the event 
+*loop.
+*
+*Input: 
+*	a: signal
+*
+*Return: none
+*/
+void statsSignal(int signo) {
+
+	(void) signo;
+	statsWanted++;
 }
 
-/*This function sends a message to client that tells client
-*that the file is empty, closes file, and sockets and 
-*terminates the program according to what type of termination 
-*it is (error/normal).
+/*This function handles a read of a shard past its end, after the file got smaller while
+*it was followed and before the server read the event of it. The shard is marked as 
+*shrunk and its cursor is stopped, and the read is counted in mappingsLost. So that the
+*read can go on the page is replaced by a page of zeros, but the zeros are never sent:
+*fillBatch makes a batch that was made meanwhile again, and a client whose output 
+*points past the new end is closed. A SIGBUS anywhere else is left to kill the server, 
+*like without -f.
 *
 *Input: 
-*	a: type of termination
+*	a: signal
+*	b: where it happened
+*	c: unused
 *
 *Return: none
 */
-void terminator(char msg) {
+void mappingLost(int signo, siginfo_t *info, void *context) {
 
-	if (socketConnection == CONNECTED) sendTerminationMsgToClient();
-	close(fp);
-	close(welcomeSocket);
-	close(newSocket);
+	(void) context;
+	long pageSize = sysconf(_SC_PAGESIZE);
+	char *page = (char *) ((uintptr_t) info->si_addr & ~(uintptr_t) (pageSize - 1));
+	for (int s = 0; s < shardCount; s++) {
+		if (!jobFileContains(shards[s], info->si_addr)) continue;
+		shards[s]->shrunk = 1;
+		shards[s]->stop = shards[s]->next;
+		mappingsLost++;
+		if (mmap(page, pageSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) return;
+	}
+	signal(signo, SIG_DFL);
+}
+
+/*This function saves the first job that isn't delivered in the state file of every 
+*shard. That is the first job of the oldest batch from the shard that is still being 
+*sent, or the cursor of the shard if no batch is. It is only saved if CHECKPOINTMS 
+*milliseconds have passed since the last time, unless now is set, so the state file is
+*synced at most that often.
+*
+*Input: 
+*	a: 1 to save it now
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int checkpoint(int now) {
+
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	long ms = (t.tv_sec - lastCheckpoint.tv_sec) * 1000 + (t.tv_nsec - lastCheckpoint.tv_nsec) / 1000000;
+	if (!now && ms < CHECKPOINTMS) return 0;
+	lastCheckpoint = t;
+
+	for (int s = 0; s < shardCount; s++) {
+		size_t first = shards[s]->next;
+		for (struct client *c = clients; c != NULL; c = c->next) {
+			if (c->batchOpen && !c->ranged && c->batchShard == shards[s] && c->batchFirst < first) first = c->batchFirst;
+		}
+		if (jobFileCheckpoint(shards[s], first) == -1) return -1;
+	}
+	return 0;
+}
+
+/*This function adds a message to the pending output of a client. The message is not
+*copied, so it has to stay where it is until it is written. A message that directly 
+*follows the previous one in memory, like the next record of the mapped file, only 
+*makes the previous entry longer. The iovec array of a client is kept and reused for
+*every batch.
+*
+*Input: 
+*	a: client
+*	b: message
+*	c: length of message
+*
+*Return: 
+*0 for success, -1 for error
+*/
+int appendToClient(struct client *c, char *msg, size_t length) {
+
+	if (c->iovCount > 0) {
+		struct iovec *last = &c->iov[c->iovCount-1];
+		if ((char *) last->iov_base + last->iov_len == msg) {
+			last->iov_len += length;
+			return 0;
+		}
+	}
+
+	if (c->iovCount == c->iovCap) {
+		int cap = c->iovCap ? 2 * c->iovCap : 16;
+		struct iovec *iov = realloc(c->iov, cap * sizeof(struct iovec));
+		if (iov == NULL) {
+			perror("realloc()");
+			return -1;
+		}
+		c->iov = iov;
+		c->iovCap = cap;
+	}
+	c->iov[c->iovCount].iov_base = msg;
+	c->iov[c->iovCount].iov_len = length;
+	c->iovCount++;
+	return 0;
+}
+
+/*This function interprets the requests in the input buffer of a client. The first
+*byte of a request is looked up in the table of requests, wich gives the function that
+*executes it and how long it is. A request that is only partly received waits for the 
+*rest. If the client terminated 1 is returned, if it was due to an error or a message
+*that isn't understood -1 is returned. A hello is only understood as the very first
+*message, and anything else as the first message makes the client a version 1 client.
+*Once a request has produced output the rest of the buffer is left until that output
+*is written, and then the whole batch is flushed at once.
+*
+*Input: 
+*	a: client
+*
+*Return: 
+*0 for success, 1 if the client terminated, -1 for error
+*/
+int executeJob(struct client *c) {
+	
+	size_t pos = 0;
+	while (pos < c->inLen && c->iovCount == 0 && c->remaining == 0) {
+
+		struct request *r = &requests[(unsigned char) c->in[pos]];
+		if (c->version == 0 && c->in[pos] != HELLO) c->version = 1;
+		if (r->execute == NULL) return -1; //Client didn't understand msg
+
+		size_t length = r->length[c->version];
+		if (length == 0) return -1; //Not in the version of the client
+		if (c->inLen - pos < length) break; //Wait for the rest of it
+		if (r->framed) {
+			uint32_t rest = getLength(c->in + pos + 1);
+			if (rest > INBUFSIZE - V2HEADER) return -1; //Would never fit
+			length = V2HEADER + rest;
+			if (c->inLen - pos < length) break;
+		}
+		testValue = r->execute(c, c->in + pos);
+		if (testValue != 0) return testValue;
+		pos += length;
+	}
+
+	memmove(c->in, c->in + pos, c->inLen - pos);
+	c->inLen -= pos;
+
+	if (c->iovCount > 0) return flushClient(c);
+	return watchClient(c);
+}
+
+/*This function executes a GETJOB request, wich is followed by the number of jobs the 
+*client wants (numJobs), as one byte (version 1) or four bytes (version 2).
+*
+*Input: 
+*	a: client
+*	b: request
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int jobRequest(struct client *c, char *msg) {
+
+	return getJob(c, c->version == 1 ? (unsigned char) msg[1] : getLength(msg + 1));
+}
+
+/*This function executes a FILTER request, wich replaces the filter of the client. The
+*shards are looked through from the start again for the new filter.
+*
+*Input: 
+*	a: client
+*	b: request
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int filterRequest(struct client *c, char *msg) {
+
+	if (c->filter == NULL && (c->filter = malloc(sizeof(struct jobFilter))) == NULL) {
+		perror("malloc()");
+		return -1;
+	}
+	if (filterDecode(c->filter, msg + V2HEADER, getLength(msg + 1)) == -1) {
+		printf("Broken filter from a client\n");
+		return -1;
+	}
+	if (c->scan != NULL) memset(c->scan, 0, c->scanCap * sizeof(size_t));
+	return 0;
+}
+
+/*This function executes a GETRANGE request. The range is turned into job numbers through
+*all the shards, and the answer with the number of jobs in it is added to the output. The
+*jobs are then sent by fillRange, in batches like for GETJOB. A range of more than 2^32-1
+*jobs is cut there.
+*
+*Input: 
+*	a: client
+*	b: request
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int rangeRequest(struct client *c, char *msg) {
+
+	uint64_t first = ((uint64_t) getLength(msg + 2) << 32) | getLength(msg + 6);
+	uint64_t count = ((uint64_t) getLength(msg + 10) << 32) | getLength(msg + 14);
+	uint64_t end = first + count < first ? UINT64_MAX : first + count;
+
+	if (msg[1] == RANGEBYTES) {
+		first = jobAtOffset(first);
+		end = jobAtOffset(end);
+	}
+	else if (msg[1] != RANGEJOBS) return -1;
+
+	stats.requests++;
+	c->ranged = 1;
+	c->rangeNext = first;
+	c->remaining = indexedJobs(first, end);
+
+	char *answer = c->headers;
+	answer[0] = GETRANGE;
+	putLength(answer + 1, RANGEFRAME - V2HEADER);
+	putLength(answer + V2HEADER, c->remaining);
+	c->headersLen = RANGEFRAME;
+	c->run = NULL;
+	if (appendToClient(c, answer, RANGEFRAME) == -1) return -1;
+	return fillRange(c);
+}
+
+/*This function finds the shard of a job that is numbered through all the shards.
+*
+*Input: 
+*	a: the number of the job, wich is changed to its number in the shard
+*
+*Return: 
+*the shard, NULL if the job is after the last one
+*/
+struct jobFile * shardOfJob(size_t *job) {
+
+	for (int s = 0; s < shardCount; s++) {
+		if (*job < shards[s]->jobCount) return shards[s];
+		*job -= shards[s]->jobCount;
+	}
+	return NULL;
+}
+
+/*This function finds the first job whose record starts at or after a byte offset, with 
+*the files of the shards one after the other. It is found by a binary search in the
+*index of the shard the offset is in.
+*
+*Input: 
+*	a: byte offset
+*
+*Return: 
+*the number of the job through all the shards
+*/
+size_t jobAtOffset(uint64_t offset) {
+
+	size_t before = 0;
+	for (int s = 0; s < shardCount; s++) {
+
+		struct jobFile *jf = shards[s];
+		if (offset < jf->mapLen) {
+			size_t low = jf->firstJob, high = jf->jobCount;
+			while (low < high) {
+				size_t middle = low + (high - low) / 2;
+				if (jf->offsets[middle - jf->firstJob] < offset) low = middle + 1;
+				else high = middle;
+			}
+			return before + low;
+		}
+		offset -= jf->mapLen;
+		before += jf->jobCount;
+	}
+	return before;
+}
+
+/*This function counts the jobs in a range of job numbers through all the shards that are
+*in the indexes, wich are all of them unless a resumed server skipped the first ones.
+*
+*Input: 
+*	a: first job
+*	b: job after the last one
+*
+*Return: 
+*the number of jobs, at most 2^32-1
+*/
+uint32_t indexedJobs(size_t first, size_t end) {
+
+	uint64_t count = 0, before = 0;
+	for (int s = 0; s < shardCount; s++) {
+
+		struct jobFile *jf = shards[s];
+		uint64_t from = before + jf->firstJob, to = before + jf->jobCount;
+		if (first > from) from = first;
+		if (end < to) to = end;
+		if (from < to) count += to - from;
+		before += jf->jobCount;
+	}
+	return count > UINT32_MAX ? UINT32_MAX : count;
+}
+
+/*This function executes the message a client sends when it terminates.
+*
+*Input: 
+*	a: client
+*	b: NORMALTERMINATE or ERRORTERMINATE
+*
+*Return: 
+*1 if the client terminated normally, -1 if it was due to an error
+*/
+int endRequest(struct client *c, char *msg) {
+
+	(void) c;
+	return msg[0] == NORMALTERMINATE ? 1 : -1;
+}
+
+/*This function answers the hello from a version 2 client with the version and the
+*features both sides support. The buffer for the headers of a batch is allocated here,
+*once, so that it never moves while the output points into it. So is the compression
+*state and the buffer for compressed frames, if the client wants compression. A client
+*on the Unix socket that wants the shared memory feature gets its ring here, and the
+*answer is sent at once with the ring attached, instead of added to the output.
+*
+*Input: 
+*	a: client
+*	b: hello message
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int helloFromClient(struct client *c, char *msg) {
+
+	if (c->version != 0) return -1; //Only as the first message
+	c->version = (unsigned char) msg[1] < PROTOCOLVERSION ? (unsigned char) msg[1] : PROTOCOLVERSION;
+	if (c->version < 1) return -1;
+	c->features = getLength(msg + 2) & FEATURES;
+	if ((c->features & FEATURESHM) && (!c->local || startLink(c) == -1)) c->features &= ~FEATURESHM;
+	if (c->features & FEATURECOMPRESS) c->features &= ~FEATURERECORDS;
+
+	if ((c->headers = malloc((BATCHJOBS + 1) * V2HEADER + HELLOLENGTH + RANGEFRAME)) == NULL) {
+		perror("malloc()");
+		return -1;
+	}
+	if (c->features & FEATURECOMPRESS) {
+		if ((c->packed = malloc(PACKEDSIZE)) == NULL) {
+			perror("malloc()");
+			return -1;
+		}
+		if (deflateInit(&c->zs, Z_BEST_SPEED) != Z_OK) {
+			printf("deflateInit(): %s\n", c->zs.msg ? c->zs.msg : "failed");
+			c->features &= ~FEATURECOMPRESS;
+		}
+	}
+	char *answer = c->headers;
+	answer[0] = HELLO;
+	answer[1] = c->version;
+	putLength(answer + 2, c->features);
+	if (c->features & FEATURESHM) {
+		if (shmSendHello(c->sock, answer, HELLOLENGTH, &c->link) == -1) return -1;
+		close(c->link.memFd);
+		c->link.memFd = -1;
+		return 0;
+	}
+	c->headersLen = HELLOLENGTH;
+	return appendToClient(c, answer, HELLOLENGTH);
+}
+
+/*This function makes the shared memory ring of a client and registers its spaceFd in
+*the epoll instance, without waiting for anything yet.
+*
+*Input: 
+*	a: client
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int startLink(struct client *c) {
+
+	if (shmCreate(&c->link) == -1) return -1;
+
+	struct epoll_event ev;
+	ev.events = 0;
+	ev.data.ptr = (char *) c + SPACETAG;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, c->link.spaceFd, &ev) == -1) {
+		perror("epoll_ctl()");
+		shmClose(&c->link);
+		return -1;
+	}
+	return 0;
+}
+
+/*This function takes an argument numJobs, wich is how many jobs the client asked 
+*for, and makes the first batch of them.
+*
+*Input: 
+*	a: client asking for jobs
+*	b: number of jobs to read from file
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int getJob(struct client *c, uint32_t numJobs) {
+		
+	stats.requests++;
+	c->remaining = numJobs;
+	c->ranged = 0;
+	return fillBatch(c);
+}
+
+/*This function makes the next batch of a client, with fillRange for a GETRANGE request 
+*and fillJobs otherwise. With -f the events of the shards are read first, so that a 
+*shard that got smaller is stopped before its mapping is read past the new end. If a 
+*shard got smaller while the batch was made anyway, its mapping read zeros from there,
+*so the output of the batch is dropped, its jobs are given back and it is made again,
+*without the shard.
+*
+*Input: 
+*	a: client asking for jobs
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int fillBatch(struct client *c) {
+
+	if (follow) shardsChanged(0);
+	sig_atomic_t lost = mappingsLost;
+	int iovCount = c->iovCount;
+	size_t headersLen = c->headersLen, packedLen = c->packedLen;
+	uint32_t remaining = c->remaining;
+	uint64_t jobs = stats.jobs;
+	if ((c->ranged ? fillRange(c) : fillJobs(c)) == -1) return -1;
+	if (mappingsLost == lost || c->iovCount == iovCount) return 0;
+
+	printf("A shard got smaller while a batch was made from it, the batch is made again\n");
+	returnJobs(c);
+	c->iovCount = iovCount;
+	c->headersLen = headersLen;
+	c->packedLen = packedLen;
+	c->run = NULL;
+	c->remaining = remaining;
+	c->batchOpen = 0;
+	stats.jobs = jobs;
+	return fillBatch(c);
+}
+
+/*This function makes a for loop that loops until the batch has BATCHJOBS jobs, or the 
+*request has no jobs left, or is broken by an error or end of file. The whole batch is
+*taken from the shard whose turn it is, and if that shard runs out the batch ends there
+*and the next batch takes another one. A client with a filter takes its batch from the
+*next shard that has a job for it. In the loop readFile is called and if that 
+*returns -1 that means that there is an error and -1 is returned, if not 0 is always
+*returned. Even if readFile returns 1 wich indicates that every shard is finished, in
+*wich case the request has no jobs left. With -f the client isn't told that, but is 
+*marked as starved and gets no batch, until the shards grow. With several threads it 
+*isn't told either, as long as there is a thread it hasn't been to since its last job, 
+*but is marked to be handed over to the next thread. The batch is then compressed by 
+*packBatch. A client whose filter has checked SCANLIMIT jobs in this round without 
+*finding one is marked as scanning, and gets its batch in a later round.
+*
+*Input: 
+*	a: client asking for jobs
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int fillJobs(struct client *c) {
+
+	if (c->filter != NULL && c->scanRound != rounds) {
+		c->scanRound = rounds;
+		c->scanLeft = SCANLIMIT;
+	}
+	struct jobFile *jf = c->filter != NULL ? filteredShard(c) : nextShard(1);
+	if (c->filter != NULL && jf == NULL && c->scanCap < 0) return -1;
+	if (c->filter != NULL && jf == NULL && c->scanLeft == 0) {
+		c->starved = c->scanning = 1;
+		scanningCount++;
+		return 0;
+	}
+	if (follow && jf == NULL) {
+		c->starved = 1;
+		return 0;
+	}
+	if (jf == NULL && inboxes != NULL && c->hops < serverThreads - 1) {
+		c->starved = c->moving = 1;
+		movingCount++;
+		return 0;
+	}
+	if (c->batchJobs == NULL && (c->batchJobs = malloc(BATCHJOBS * sizeof(struct batchJob))) == NULL) {
+		perror("malloc()");
+		return -1;
+	}
+	c->batchJobCount = 0;
+	c->batchShard = jf;
+	c->batchFirst = jf != NULL ? jf->next : 0;
+	c->batchOpen = 1;
+	c->batchMade = metricsNow();
+	for (int i = 0; i < BATCHJOBS && c->remaining > 0; i++) {
+		if (i > 0 && peekJob(c, jf) == jf->stop) break;
+		testValue = readFile(c);
+		if (testValue == -1) return -1;
+		if (testValue == 1) c->remaining = 0;
+		else {
+			c->remaining--;
+			stats.jobs++;
+		}
+	}
+	packBatch(c);
+	stats.batches++;
+	histogramAdd(&stats.batchBuild, metricsNow() - c->batchMade);
+	return 0;
+}
+
+/*This function makes the next batch of a GETRANGE request. A batch is taken from one
+*shard, like for GETJOB, so it ends where the shard does. Jobs that aren't in the index
+*of a shard are skipped.
+*
+*Input: 
+*	a: client
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int fillRange(struct client *c) {
+
+	size_t job = c->rangeNext;
+	struct jobFile *jf = shardOfJob(&job);
+	if (jf == NULL || jf->shrunk) { //The shards have changed, or the shard got smaller
+		c->remaining = 0;
+		return 0;
+	}
+	if (job < jf->firstJob) {
+		c->rangeNext += jf->firstJob - job;
+		job = jf->firstJob;
+	}
+
+	c->batchShard = jf;
+	c->batchFirst = job;
+	c->batchOpen = 1;
+	c->batchMade = metricsNow();
+	for (int i = 0; i < BATCHJOBS && c->remaining > 0 && job < jf->jobCount; i++) {
+
+		size_t length;
+		char *record = jobFileRecord(jf, job++, &length);
+		if (appendJob(c, record, length) == -1) return -1;
+		c->rangeNext++;
+		c->remaining--;
+		stats.jobs++;
+	}
+	packBatch(c);
+	stats.batches++;
+	histogramAdd(&stats.batchBuild, metricsNow() - c->batchMade);
+	return 0;
+}
+
+/*This function finds the shard a client with a filter takes its next batch from, wich is
+*the first one from the one whose turn it is that has a job left that matches. Shards 
+*without jobs of the types of the filter aren't looked through. The array with how far 
+*the client has looked in every shard grows with the shards. If that fails an error 
+*message is printed, and scanCap is set to -1.
+*
+*Input: 
+*	a: client
+*
+*Return: 
+*the shard, NULL if no shard has a job for the client
+*/
+struct jobFile * filteredShard(struct client *c) {
+
+	if (c->scanCap < shardCount) {
+		size_t *scan = realloc(c->scan, shardCount * sizeof(size_t));
+		if (scan == NULL) {
+			perror("realloc()");
+			c->scanCap = -1;
+			return NULL;
+		}
+		memset(scan + c->scanCap, 0, (shardCount - c->scanCap) * sizeof(size_t));
+		c->scan = scan;
+		c->scanCap = shardCount;
+	}
+
+	for (int i = 0; i < shardCount; i++) {
+		int s = (shardTurn + i) % shardCount;
+		c->batchScan = &c->scan[s];
+		if (!shardHasTypes(c, shards[s])) continue;
+		if (peekJob(c, shards[s]) < shards[s]->stop) {
+			shardTurn = (s + 1) % shardCount;
+			return shards[s];
+		}
+	}
+	return NULL;
+}
+
+/*This function tells if a shard has any jobs of the types in the filter of a client.
+*
+*Input: 
+*	a: client with a filter
+*	b: shard
+*
+*Return: 
+*1 if it has, 0 if not
+*/
+int shardHasTypes(struct client *c, struct jobFile *jf) {
+
+	for (int t = 0; t < 256; t++) {
+		if ((c->filter->types[t >> 3] & (1 << (t & 7))) && jf->typeCounts[t] > 0) return 1;
+	}
+	return 0;
+}
+
+/*This function finds the next job a client would get from a shard, without taking it.
+*Without a filter that is the job under the cursor. With a filter it is the first job 
+*from where the client has looked to that isn't taken and matches, and the client has
+*looked up to it. The jobs are checked straight in the mapping, from the index. When 
+*the client has no jobs left to check in this round the shard counts as having none.
+*
+*Input: 
+*	a: client
+*	b: shard, that batchScan belongs to
+*
+*Return: 
+*the number of the job, stop if there is none
+*/
+size_t peekJob(struct client *c, struct jobFile *jf) {
+
+	if (c->filter == NULL) return jf->next;
+
+	size_t job = *c->batchScan > jf->next ? *c->batchScan : jf->next;
+	for (; job < jf->stop; job++) {
+		if (!jobFileTaken(jf, job)) {
+			size_t length;
+			char *record = jobFileRecord(jf, job, &length);
+			if (filterMatch(c->filter, record[0], record + V1HEADER, length - V1HEADER)) break;
+		}
+		if (c->scanLeft == 0) {
+			*c->batchScan = job;
+			return jf->stop;
+		}
+		c->scanLeft--;
+	}
+	*c->batchScan = job;
+	return job;
+}
+
+/*This function compresses the batch of a client that has the compression feature. A job
+*starts with its header, wich is the only entry of the output that isn't in the mapped
+*job file, so the output is cut in front of headers into pieces of at most PACKCHUNK
+*bytes. Each piece is replaced by one 'Z' frame, wich is type, length, the length of the
+*piece uncompressed and the compressed piece, if that is at least 1/8 smaller. Otherwise
+*the entries of the piece are kept. The output array is rewritten in place, since a piece
+*never gets more entries than it had, and the entry every job of the batch ends before 
+*is moved along. If the batch as a whole didn't get 1/8 smaller it counts as a miss, 
+*and after PACKMISSES misses in a row the next PACKPAUSE batches are sent as they are.
+*
+*Input: 
+*	a: client
+*
+*Return: none
+*/
+void packBatch(struct client *c) {
+
+	if (!(c->features & FEATURECOMPRESS) || c->iovCount == 0) return;
+	if (c->packPause > 0) {
+		c->packPause--;
+		return;
+	}
+
+	size_t rawTotal = 0, sentTotal = 0;
+	int from = 0, count = 0, job = 0;
+	while (from < c->iovCount) {
+
+		/*Take whole jobs until the piece is full*/
+		int to = from;
+		size_t raw = 0;
+		while (to < c->iovCount) {
+			int end = to + 1;
+			size_t size = c->iov[to].iov_len;
+			while (end < c->iovCount && jobFileContains(c->batchShard, c->iov[end].iov_base)) size += c->iov[end++].iov_len;
+			if (to > from && raw + size > PACKCHUNK) break;
+			raw += size;
+			to = end;
+		}
+
+		char *frame = c->packed + c->packedLen;
+		size_t n = packJobs(c, from, to, frame + PACKHEADER, raw - raw / 8 - PACKHEADER);
+		rawTotal += raw;
+
+		if (n > 0) {
+			frame[0] = COMPRESSED;
+			putLength(frame + 1, n + PACKHEADER - V2HEADER);
+			putLength(frame + V2HEADER, raw);
+			c->packedLen += n + PACKHEADER;
+			sentTotal += n + PACKHEADER;
+			stats.packedFrames++;
+			stats.packedSaved += raw - n - PACKHEADER;
+
+			if (count > 0 && (char *) c->iov[count-1].iov_base + c->iov[count-1].iov_len == frame) {
+				c->iov[count-1].iov_len += n + PACKHEADER;
+			} else {
+				c->iov[count].iov_base = frame;
+				c->iov[count++].iov_len = n + PACKHEADER;
+			}
+		} else {
+			memmove(&c->iov[count], &c->iov[from], (to - from) * sizeof(struct iovec));
+			count += to - from;
+			sentTotal += raw;
+		}
+		for (; job < c->batchJobCount && c->batchJobs[job].end <= to; job++) {
+			c->batchJobs[job].end = n > 0 ? count : c->batchJobs[job].end - to + count;
+		}
+		from = to;
+	}
+	c->iovCount = count;
+
+	if (sentTotal > rawTotal - rawTotal / 8) {
+		if (++c->packMisses == PACKMISSES) {
+			c->packMisses = 0;
+			c->packPause = PACKPAUSE;
+		}
+	}
+	else c->packMisses = 0;
+}
+
+/*This function compresses the output entries from to to of a client into one zlib stream.
+*The stream is given at most limit bytes, so a piece that doesn't compress well enough 
+*is given up on as soon as it runs out of room.
+*
+*Input: 
+*	a: client
+*	b: first entry
+*	c: entry after the last one
+*	d: where the compressed piece is written
+*	e: the most bytes it may take
+*
+*Return: 
+*length of the compressed piece, 0 if it didn't fit
+*/
+size_t packJobs(struct client *c, int from, int to, char *out, size_t limit) {
+
+	if ((ssize_t) limit <= 0 || deflateReset(&c->zs) != Z_OK) return 0;
+	c->zs.next_out = (Bytef *) out;
+	c->zs.avail_out = limit;
+
+	int status = Z_OK;
+	for (int i = from; i < to; i++) {
+		c->zs.next_in = (Bytef *) c->iov[i].iov_base;
+		c->zs.avail_in = c->iov[i].iov_len;
+		status = deflate(&c->zs, i == to - 1 ? Z_FINISH : Z_NO_FLUSH);
+		if (status != Z_OK || c->zs.avail_in > 0) break;
+	}
+	if (status != Z_STREAM_END) return 0;
+	return limit - c->zs.avail_out;
+}
+
+/*This function opens the shards given by the user. A directory gives all the shards in
+*it, sorted by name, and is watched for new ones. A name with '*', '?' or '[' in it is a
+*glob pattern, and anything else is a single job file as before. Only regular files are
+*shards. With -f every shard is watched as well, and a directory is watched for new 
+*files from when they are created. Every shard is given to add. If that fails, then an
+*error message is printed.
+*
+*Input: 
+*	a: addShard, or openShared before the threads start
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int openFile(int (*add)(char *path)) {
+
+	struct stat st;
+	if (stat(filename, &st) == 0 && S_ISDIR(st.st_mode)) {
+
+		shardDir = filename;
+		if ((inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1 || 
+				inotify_add_watch(inotifyFd, shardDir, IN_CLOSE_WRITE | IN_MOVED_TO | (follow ? IN_CREATE : 0)) == -1) {
+			perror("inotify");
+			return -1;
+		}
+
+		struct dirent **names;
+		int n = scandir(shardDir, &names, NULL, alphasort);
+		if (n == -1) {
+			perror("scandir()");
+			return -1;
+		}
+		int status = 0, found = 0;
+		for (int i = 0; i < n; i++) {
+			if (status == 0 && isShardName(names[i]->d_name)) {
+				char path[strlen(shardDir) + strlen(names[i]->d_name) + 2];
+				sprintf(path, "%s/%s", shardDir, names[i]->d_name);
+				if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+					status = add(path);
+					found++;
+				}
+			}
+			free(names[i]);
+		}
+		free(names);
+		if (found == 0 && (serverThreads == 1 || add == openShared)) printf("Waiting for job files in %s\n", shardDir);
+		return status;
+	}
+
+	if (follow && (inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+		perror("inotify");
+		return -1;
+	}
+	if (strpbrk(filename, "*?[") == NULL) return add(filename);
+
+	glob_t g;
+	if (glob(filename, 0, NULL, &g) != 0) {
+		printf("No job files match %s\n", filename);
+		return -1;
+	}
+	int status = 0;
+	for (size_t i = 0; i < g.gl_pathc && status == 0; i++) {
+		char *name = strrchr(g.gl_pathv[i], '/') ? strrchr(g.gl_pathv[i], '/') + 1 : g.gl_pathv[i];
+		if (isShardName(name) && stat(g.gl_pathv[i], &st) == 0 && S_ISREG(st.st_mode)) status = add(g.gl_pathv[i]);
+	}
+	globfree(&g);
+	return status;
+}
+
+/*This function maps a job file and indexes its jobs, or takes the index from the sidecar 
+*that jobindex made, and adds it to the shards. The number of jobs of every type is 
+*printed, and where the server resumes with -r. With several threads the mapping and 
+*the index are shared with the other threads instead, and the thread only keeps its own
+*range of the jobs, wich is printed. With io_uring the file is registered as well, and
+*with -f it is watched.
+*
+*Input: 
+*	a: name of the job file
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int addShard(char *path) {
+
+	if (shardCount == shardCap) {
+		int cap = shardCap ? 2 * shardCap : 8;
+		struct jobFile **s = realloc(shards, cap * sizeof(struct jobFile *));
+		if (s == NULL) {
+			perror("realloc()");
+			return -1;
+		}
+		shards = s;
+		shardCap = cap;
+	}
+	struct jobFile *jf = malloc(sizeof(struct jobFile));
+	if (jf == NULL) {
+		perror("malloc()");
+		return -1;
+	}
+	if (serverThreads > 1) {
+		struct jobFile *from = sharedFile(path);
+		if (from == NULL || jobFileShare(jf, from) == -1) {
+			free(jf);
+			return -1;
+		}
+		jobFilePart(jf, threadNr, serverThreads);
+	}
+	else if (jobFileOpen(jf, path, JOBINDEX | (resume ? JOBRESUME : 0)) == -1) {
+		free(jf);
+		return -1;
+	}
+	if (fixedFiles && (jf->fd >= MAXFIXEDFILES || ringUpdateFile(&ring, jf->fd, jf->fd) == -1)) {
+		jobFileClose(jf);
+		free(jf);
+		return -1;
+	}
+	if (follow && watchShard(jf) == -1) {
+		jobFileClose(jf);
+		free(jf);
+		return -1;
+	}
+	shards[shardCount++] = jf;
+
+	if (serverThreads > 1) printf("Thread %d serves jobs %zu to %zu of %s\n", threadNr, jf->next, jf->stop, path);
+	else printShard(jf);
+	return 0;
+}
+
+/*This function opens a job file for the threads to share, before they start.
+*
+*Input: 
+*	a: name of the job file
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int openShared(char *path) {
+
+	return sharedFile(path) == NULL ? -1 : 0;
+}
+
+/*This function finds the job file that the threads share by its name. One that isn't 
+*open yet is mapped and indexed, or its index is taken from the sidecar, while the 
+*other threads wait, and the number of jobs of every type is printed. If any of it 
+*fails an error message is printed.
+*
+*Input: 
+*	a: name of the job file
+*
+*Return: 
+*the shared job file, NULL for error
+*/
+struct jobFile * sharedFile(char *path) {
+
+	struct jobFile *jf = NULL;
+	pthread_mutex_lock(&sharedLock);
+	for (int s = 0; s < sharedCount && jf == NULL; s++) if (strcmp(sharedFiles[s]->name, path) == 0) jf = sharedFiles[s];
+	if (jf != NULL) {
+		pthread_mutex_unlock(&sharedLock);
+		return jf;
+	}
+
+	if (sharedCount == sharedCap) {
+		int cap = sharedCap ? 2 * sharedCap : 8;
+		struct jobFile **s = realloc(sharedFiles, cap * sizeof(struct jobFile *));
+		if (s == NULL) {
+			perror("realloc()");
+			pthread_mutex_unlock(&sharedLock);
+			return NULL;
+		}
+		sharedFiles = s;
+		sharedCap = cap;
+	}
+	if ((jf = malloc(sizeof(struct jobFile))) == NULL) perror("malloc()");
+	else if (jobFileOpen(jf, path, JOBINDEX) == -1) {
+		free(jf);
+		jf = NULL;
+	}
+	else {
+		sharedFiles[sharedCount++] = jf;
+		printShard(jf);
+	}
+	pthread_mutex_unlock(&sharedLock);
+	return jf;
+}
+
+/*This function prints the number of jobs of a job file that was opened, and of every 
+*type, and where the server resumes with -r.
+*
+*Input: 
+*	a: job file
+*
+*Return: none
+*/
+void printShard(struct jobFile *jf) {
+
+	printf("%zu jobs in %s%s", jf->jobCount, jf->name, jf->indexMap != NULL ? " (indexed)" : "");
+	if (jf->next > 0) printf(", resuming at job %zu", jf->next);
+	printf(jf->firstJob > 0 ? ", types of the jobs left:" : ":");
+	jobFilePrintTypes(jf);
+}
+
+/*This function tells if a file in the directory of shards is a shard, and not one of the
+*sidecar files the server and jobindex write next to the shards, or a hidden file.
+*
+*Input: 
+*	a: name of the file
+*
+*Return: 
+*1 if it is, 0 if not
+*/
+int isShardName(char *name) {
+
+	char *suffixes[3] = {INDEXSUFFIX, STATESUFFIX, ".tmp"};
+	size_t len = strlen(name);
+
+	if (name[0] == '.') return 0;
+	for (int i = 0; i < 3; i++) {
+		size_t n = strlen(suffixes[i]);
+		if (len >= n && strcmp(name + len - n, suffixes[i]) == 0) return 0;
+	}
+	return 1;
+}
+
+/*This function reads the events from the watch on the directory of shards, and from 
+*the watches on the shards with -f. A file that was written and closed, or moved into the
+*directory, or with -f created in it, is added as a shard unless it already is one. A 
+*file that can't be opened is skipped with a message, it doesn't stop the server. A 
+*shard that was written to is grown by growShard, and so is a shard that was still being
+*written when it was added and is closed now. Then the clients that wait for jobs get 
+*them, if feed is set.
+*
+*Input: 
+*	a: feed the clients that wait for jobs
+*
+*Return: none
+*/
+void shardsChanged(int feed) {
+
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t n;
+
+	while ((n = read(inotifyFd, buffer, sizeof(buffer))) > 0) {
+		for (char *p = buffer; p < buffer + n; p += sizeof(struct inotify_event) + ((struct inotify_event *) p)->len) {
+
+			struct inotify_event *e = (struct inotify_event *) p;
+			if (e->len == 0) {
+				for (int s = 0; s < shardCount; s++) {
+					if (shards[s]->watch == e->wd && growShard(shards[s]) == -1) printf("Couldn't grow %s\n", shards[s]->name);
+				}
+				continue;
+			}
+			if (!isShardName(e->name)) continue;
+
+			char path[strlen(shardDir) + strlen(e->name) + 2];
+			sprintf(path, "%s/%s", shardDir, e->name);
+			struct jobFile *known = NULL;
+			for (int s = 0; s < shardCount && known == NULL; s++) if (strcmp(shards[s]->name, path) == 0) known = shards[s];
+			if (known == NULL && addShard(path) == -1) printf("Skipping %s\n", path);
+			if (known != NULL && (e->mask & IN_CLOSE_WRITE) && growShard(known) == -1) printf("Couldn't grow %s\n", path);
+		}
+	}
+	if (follow && feed) feedStarved();
+}
+
+/*This function watches a shard for writes, so that it is followed.
+*
+*Input: 
+*	a: shard
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int watchShard(struct jobFile *jf) {
+
+	if ((jf->watch = inotify_add_watch(inotifyFd, jf->name, IN_MODIFY)) == -1) {
+		perror("inotify_add_watch()");
+		return -1;
+	}
+	return 0;
+}
+
+/*This function maps and indexes what was appended to a shard. If the mapping moved, the
+*pending output of the clients that still points into the old one is moved along, so 
+*the bytes it points to stay the same. io_uring and sendfile() find the offset in the
+*file from the pointer when the output is sent, so they need nothing else. A shard the 
+*threads share is read by all of them, so it isn't grown.
+*
+*Input: 
+*	a: shard
+*
+*Return: 
+*the number of new jobs, -1 for error
+*/
+int growShard(struct jobFile *jf) {
+
+	if (jf->shared) return 0;
+	char *oldMap = jf->map;
+	size_t oldLen = jf->mapLen;
+	int added = jobFileGrow(jf);
+	if (added == -1 || oldMap == NULL || jf->map == oldMap) return added;
+
+	for (struct client *c = clients; c != NULL; c = c->next) {
+		for (int i = c->iovPos; i < c->iovCount; i++) {
+			char *base = c->iov[i].iov_base;
+			if (base >= oldMap && base < oldMap + oldLen) c->iov[i].iov_base = jf->map + (base - oldMap);
+		}
+	}
+	return added;
+}
+
+/*This function gives the clients that wait for the shards to grow a new batch, if there
+*are jobs for them now. A client whose filter still matches nothing goes on waiting. A
+*client that fails is closed, wich takes it out of the list, so the next one is found
+*first.
+*
+*Input: none
+*
+*Return: none
+*/
+void feedStarved() {
+
+	struct client *next;
+	for (struct client *c = clients; c != NULL; c = next) {
+		next = c->next;
+		if (!c->starved || c->scanning || c->closed) continue;
+		c->starved = 0;
+		testValue = fillBatch(c);
+		if (testValue == 0) testValue = c->iovCount > 0 ? flushClient(c) : watchClient(c);
+		if (testValue != 0) closeClient(c);
+	}
+}
+
+/*This function lets the clients whose filter went on looking for jobs look further, and 
+*gives them a batch if they find any. A client that fails is closed.
+*
+*Input: none
+*
+*Return: none
+*/
+void feedScanning() {
+
+	struct client *next;
+	for (struct client *c = clients; c != NULL; c = next) {
+		next = c->next;
+		if (!c->scanning || c->closed) continue;
+		c->scanning = c->starved = 0;
+		scanningCount--;
+		testValue = fillBatch(c);
+		if (testValue == 0) testValue = c->iovCount > 0 ? flushClient(c) : watchClient(c);
+		if (testValue != 0) closeClient(c);
+	}
+}
+
+/*This function finds the shard whose turn it is to give a batch. The shards take turns,
+*and shards that have no jobs left are skipped. Unless take is set the turn isn't moved,
+*so it only tells wich shard is next.
+*
+*Input: 
+*	a: 1 to take the turn
+*
+*Return: 
+*the shard, NULL if every shard is finished
+*/
+struct jobFile * nextShard(int take) {
+
+	for (int i = 0; i < shardCount; i++) {
+		int s = (shardTurn + i) % shardCount;
+		if (shards[s]->next < shards[s]->stop) {
+			if (take) shardTurn = (s + 1) % shardCount;
+			return shards[s];
+		}
+	}
+	return NULL;
+}
+
+/*This function takes the next job for the client, found by peekJob, from the mapped file.
+*If there is none sendTerminationMsgToClient is called, wich indicates that the file 
+*is empty/finished. If not then the record, wich is jobtype, textlength and jobtext, 
+*is added to the output of the client by appendJob.
+*
+*Input:
+*	a: client asking for the job, from the shard of its batch
+*
+*Return: 
+0 successful execution, 1 for end of file, -1 for error
+*/
+int readFile(struct client *c) {
+
+	struct jobFile *jf = c->batchShard;
+	size_t job = jf != NULL ? peekJob(c, jf) : 0;
+	if (jf != NULL && job < jf->stop) { //Send job to client
+
+		size_t length;
+		char *record = jobFileRecord(jf, job, &length);
+		if (jobFileTake(jf, job) == -1) return -1;
+		if (c->filter != NULL) *c->batchScan = job + 1;
+		if (appendJob(c, record, length) == -1) return -1;
+		c->batchJobs[c->batchJobCount].job = job;
+		c->batchJobs[c->batchJobCount++].end = c->iovCount;
+		c->hops = 0;
+
+	} else { //Inform client that there are no jobs left	
+
+		if (sendTerminationMsgToClient(c) == -1) return -1;
+		return 1;
+	}
+	return 0;	
+}
+
+/*This function adds a record from the mapped file to the output of a client. A version 2
+*client gets a new header with a 32 bit textlength in front of the jobtext instead of the
+*header of the record. With the records feature the record is added as it is to the open
+*RECORDS frame, if it follows the last record in the file and the frame has room for it,
+*otherwise a new frame is started.
+*
+*Input:
+*	a: client
+*	b: record
+*	c: length of the record
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int appendJob(struct client *c, char *record, size_t length) {
+
+	if (c->version != 2) return appendToClient(c, record, length);
+
+	if (c->features & FEATURERECORDS) {
+		struct iovec *last = c->iovCount > 0 ? &c->iov[c->iovCount-1] : NULL;
+		if (c->run != NULL && last != NULL && (char *) last->iov_base + last->iov_len == record &&
+				getLength(c->run + 1) + length <= MAXRECORDS) {
+			putLength(c->run + 1, getLength(c->run + 1) + length);
+			last->iov_len += length;
+			return 0;
+		}
+		c->run = c->headers + c->headersLen;
+		c->run[0] = RECORDS;
+		putLength(c->run + 1, length);
+		c->headersLen += V2HEADER;
+		if (appendToClient(c, c->run, V2HEADER) == -1) return -1;
+		return appendToClient(c, record, length);
+	}
+
+	char *header = c->headers + c->headersLen;
+	header[0] = record[0];
+	putLength(header + 1, length - V1HEADER);
+	c->headersLen += V2HEADER;
+	if (appendToClient(c, header, V2HEADER) == -1) return -1;
+	return appendToClient(c, record + V1HEADER, length - V1HEADER);
+}
+
+/*This function adds a message to the output of a client with 'Q' and the number 0,
+*in the format of the client's version. Wich will make the client terminate. 
+*
+*Input: 
+*	a: client
+*
+*Return:
+*0 for success, -1 for error
+*/
+int sendTerminationMsgToClient(struct client *c) {
+
+	if (c->version == 2) return appendToClient(c, emptyFileMsgV2, sizeof(emptyFileMsgV2));
+	return appendToClient(c, emptyFileMsg, sizeof(emptyFileMsg));
+}
+
+/*This function calls stopServer and terminates the program according to what type
+*of termination it is (error/normal).
+*
+*Input: 
+*	a: type of termination
+*
+*Return: none
+*/
+void terminator(char msg) {
+
+	stopServer();
 	if (msg == NORMALTERMINATE) exit(EXIT_SUCCESS);
 	else exit(EXIT_FAILURE);
 }
+
+/*This function sends a message to every connected client of the thread that tells 
+*the client that there are no more jobs, and closes file and sockets. The message is
+*sent without blocking, and not to a client that is in the middle of receiving a job.
+*With -r the position in the job file is saved first.
+*
+*Input: none
+*
+*Return: none
+*/
+void stopServer() {
+
+	for (struct client *c = clients; c != NULL; c = c->next) {
+		if (socketConnection == CONNECTED && c->iovPos == c->iovCount && c->inflight == 0) {
+			if (c->version == 2) send(c->sock, emptyFileMsgV2, sizeof(emptyFileMsgV2), MSG_NOSIGNAL | MSG_DONTWAIT);
+			else send(c->sock, emptyFileMsg, sizeof(emptyFileMsg), MSG_NOSIGNAL | MSG_DONTWAIT);
+		}
+		close(c->sock);
+	}
+	if (resume) checkpoint(1);
+	for (int s = 0; s < shardCount; s++) jobFileClose(shards[s]);
+	close(welcomeSocket);
+	if (localSocket != -1) {
+		close(localSocket);
+		unlink(localPath);
+	}
+	close(epollFd);
+	if (useRing) ringClose(&ring);
+}
+
+/*This function hands the clients that have no jobs left in this thread over to the next
+*thread. A client is taken out of the list, the epoll instance and the registered files,
+*and what it knows about the shards of this thread is dropped, before it is put in the
+*inbox of the next thread and that thread is woken. A client that still has io_uring
+*requests in flight waits for the next round.
+*
+*Input: none
+*
+*Return: none
+*/
+void handOver() {
+
+	int t = (threadNr + 1) % serverThreads, moved = 0;
+	struct client **p = &clients;
+	while (*p != NULL) {
+
+		struct client *c = *p;
+		if (!c->moving || c->inflight > 0) {
+			p = &c->next;
+			continue;
+		}
+		*p = c->next;
+		movingCount--;
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, c->sock, NULL);
+		if (fixedFiles) ringUpdateFile(&ring, c->sock, -1);
+		releaseBuffer(c);
+		free(c->scan);
+		c->scan = c->batchScan = NULL;
+		c->scanCap = 0;
+		c->batchShard = NULL;
+		c->hops++;
+
+		pthread_mutex_lock(&inboxes[t].lock);
+		c->next = inboxes[t].first;
+		inboxes[t].first = c;
+		pthread_mutex_unlock(&inboxes[t].lock);
+		moved = 1;
+	}
+	uint64_t one = 1;
+	if (moved) write(wakeFds[t], &one, sizeof(one));
+}
+
+/*This function takes the clients out of the inbox of the thread, registers them like new
+*clients and goes on with their requests. A client that can't be registered is closed.
+*
+*Input: none
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int adoptClients() {
+
+	if (inboxes == NULL) return 0;
+	pthread_mutex_lock(&inboxes[threadNr].lock);
+	struct client *c = inboxes[threadNr].first;
+	inboxes[threadNr].first = NULL;
+	pthread_mutex_unlock(&inboxes[threadNr].lock);
+
+	while (c != NULL) {
+
+		struct client *next = c->next;
+		c->next = clients;
+		clients = c;
+		c->moving = c->starved = 0;
+
+		struct epoll_event ev;
+		ev.events = 0;
+		ev.data.ptr = c;
+		testValue = 0;
+		if (!useRing && setNonBlocking(c->sock) == -1) testValue = -1;
+		else if (fixedFiles && (c->sock >= MAXFIXEDFILES || ringUpdateFile(&ring, c->sock, c->sock) == -1)) testValue = -1;
+		else if (epoll_ctl(epollFd, EPOLL_CTL_ADD, c->sock, &ev) == -1) {
+			perror("epoll_ctl()");
+			testValue = -1;
+		}
+		if (testValue == 0) testValue = fillBatch(c);
+		if (testValue == 0) testValue = c->iovCount > 0 ? flushClient(c) : watchClient(c);
+		if (testValue != 0) closeClient(c);
+		c = next;
+	}
+	return 0;
+}
+
+/*This function sets up io_uring for sending. A pool of buffers is allocated and registered, 
+*and every client that sends through the ring borrows one of them until its batch is sent.
+*A table of registered files is made with one slot per file descriptor number, and the job 
+*file is put in it. If the table can't be registered the plain file descriptors are used.
+*
+*Input: none
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int initRing() {
+
+	if (ringInit(&ring, RINGENTRIES) == -1) return -1;
+
+	ringBuffers = mmap(NULL, (size_t)RINGBUFFERS * RINGBUFSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ringBuffers == MAP_FAILED) {
+		perror("mmap()");
+		ringClose(&ring);
+		return -1;
+	}
+
+	struct iovec iov[RINGBUFFERS];
+	for (int i = 0; i < RINGBUFFERS; i++) {
+		iov[i].iov_base = ringBuffers + (size_t)i * RINGBUFSIZE;
+		iov[i].iov_len = RINGBUFSIZE;
+		freeBuffers[freeBufferCount++] = RINGBUFFERS - 1 - i;
+	}
+	if (ringRegisterBuffers(&ring, iov, RINGBUFFERS) == -1) {
+		ringClose(&ring);
+		return -1;
+	}
+
+	struct rlimit limit;
+	int slots = MAXFIXEDFILES;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t) slots) slots = limit.rlim_cur;
+
+	int *fds = malloc(slots * sizeof(int));
+	if (fds != NULL) {
+		for (int i = 0; i < slots; i++) fds[i] = -1;
+		for (int s = 0; s < shardCount; s++) if (shards[s]->fd < slots) fds[shards[s]->fd] = shards[s]->fd;
+		fixedFiles = (ringRegisterFiles(&ring, fds, slots) == 0);
+	}
+	free(fds);
+	if (!fixedFiles) printf("Using io_uring without registered files\n");
+	else printf("Using io_uring\n");
+	return 0;
+}
+
+/*This function prepares the pending output of a client as one linked chain in the ring. 
+*The client borrows a registered buffer, or waits for one if they are all taken. Every 
+*pending entry that points into the mapped job file is read from the file into the buffer, 
+*anything else is copied into it, and then a write of the whole buffer to the socket is 
+*linked behind those reads. What doesn't fit in the buffer, or comes after CHAINREADS 
+*reads, is sent by the next chain. Room for the longest chain, its reads, the write and
+*the hint, is reserved before it is started, since a chain that is split between two 
+*submits breaks. A hint to read ahead the same amount from where the job cursor is now
+*is added as well.
+*
+*Input: 
+*	a: client
+*
+*Return: 
+*0 for success, -1 for error
+*/
+int submitToRing(struct client *c) {
+
+	if (c->inflight > 0) return 0; //The completion continues from here
+	if (c->buffer == -1) {
+		if (freeBufferCount == 0) {
+			c->waiting = 1;
+			return watchClient(c);
+		}
+		c->buffer = freeBuffers[--freeBufferCount];
+		c->waiting = 0;
+	}
+
+	char *buffer = ringBuffers + (size_t)c->buffer * RINGBUFSIZE;
+	sig_atomic_t lost = mappingsLost;
+	c->sendLen = c->sent = 0;
+	c->sendPos = c->iovPos;
+	if (ringReserve(&ring, CHAINREADS + 2) == -1) return -1;
+
+	int reads = 0;
+	while (c->iovPos < c->iovCount && c->sendLen < RINGBUFSIZE) {
+
+		struct iovec *v = &c->iov[c->iovPos];
+		size_t n = v->iov_len;
+		if (n > RINGBUFSIZE - c->sendLen) n = RINGBUFSIZE - c->sendLen;
+
+		char *base = v->iov_base;
+		if (n >= RINGREADMIN && jobFileContains(c->batchShard, base)) {
+
+			if (reads++ == CHAINREADS) break;
+			struct io_uring_sqe *sqe = ringGetSqe(&ring);
+			if (sqe == NULL) return -1;
+			sqe->opcode = IORING_OP_READ_FIXED;
+			sqe->flags = IOSQE_IO_LINK | (fixedFiles ? IOSQE_FIXED_FILE : 0);
+			sqe->fd = c->batchShard->fd;
+			sqe->addr = (unsigned long)(buffer + c->sendLen);
+			sqe->len = n;
+			sqe->off = base - c->batchShard->map;
+			sqe->buf_index = c->buffer;
+			sqe->user_data = (unsigned long) c | READTAG;
+			c->inflight++;
+
+		} else memcpy(buffer + c->sendLen, base, n);
+
+		c->sendLen += n;
+		v->iov_base = base + n;
+		v->iov_len -= n;
+		if (v->iov_len == 0) c->iovPos++;
+	}
+	if (mappingsLost != lost) { //The buffer may have zeros from past the end, so nothing is written
+		c->sendLen = 0;
+		c->failed = 1;
+	}
+	if (submitWrite(c) == -1) return -1;
+
+	/*Read ahead for whoever asks next*/
+	struct jobFile *next = nextShard(0);
+	if (next != NULL) {
+		struct io_uring_sqe *sqe = ringGetSqe(&ring);
+		if (sqe != NULL) {
+			sqe->opcode = IORING_OP_FADVISE;
+			sqe->flags = fixedFiles ? IOSQE_FIXED_FILE : 0;
+			sqe->fd = next->fd;
+			sqe->off = next->offsets[next->next - next->firstJob];
+			sqe->len = c->sendLen;
+			sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+			sqe->user_data = 0;
+		}
+	}
+	return watchClient(c);
+}
+
+/*This function prepares a write of the part of the client's buffer that isn't sent yet.
+*At the end of a chain the room for it is already reserved, so the reserve never submits
+*the reads in front of it.
+*
+*Input: 
+*	a: client
+*
+*Return: 
+*0 for success, -1 for error
+*/
+int submitWrite(struct client *c) {
+
+	if (ringReserve(&ring, 1) == -1) return -1;
+	struct io_uring_sqe *sqe = ringGetSqe(&ring);
+	if (sqe == NULL) return -1;
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->flags = fixedFiles ? IOSQE_FIXED_FILE : 0;
+	sqe->fd = c->sock;
+	sqe->addr = (unsigned long)(ringBuffers + (size_t)c->buffer * RINGBUFSIZE + c->sent);
+	sqe->len = c->sendLen - c->sent;
+	sqe->buf_index = c->buffer;
+	sqe->user_data = (unsigned long) c | WRITETAG;
+	c->inflight++;
+	stats.ringWrites++;
+	return 0;
+}
+
+/*This function goes through every completed request in the ring.
+*
+*Input: none
+*
+*Return: none
+*/
+void reapRing() {
+
+	struct io_uring_cqe *cqe;
+	while ((cqe = ringPeekCqe(&ring)) != NULL) {
+
+		unsigned long data = cqe->user_data;
+		int res = cqe->res;
+		ringCqeSeen(&ring);
+		if (data == 0) continue; //Read ahead hint
+
+		struct client *c = (struct client *)(data & ~1UL);
+		if (ringCompletion(c, data & 1UL, res) != 0) closeClient(c);
+	}
+}
+
+/*This function handles one completed request of a client. When the whole chain of the
+*client has completed, the rest of the buffer is written if the socket took only part 
+*of it, the next chain is prepared if there is more output, and otherwise the buffer is
+*given to a client that waits for one and the batch is done.
+*
+*Input: 
+*	a: client
+*	b: READTAG or WRITETAG
+*	c: result of the request
+*
+*Return: 
+*0 for success, 1 if the client terminated, -1 for error
+*/
+int ringCompletion(struct client *c, int tag, int res) {
+
+	c->inflight--;
+	if (res < 0) {
+		if (res != -ECANCELED) printf("io_uring %s: %s\n", tag == READTAG ? "read" : "write", strerror(-res));
+		c->failed = 1;
+	}
+	else if (tag == WRITETAG) {
+		c->sent += res;
+		stats.bytes += res;
+	}
+
+	if (c->inflight > 0) return 0;
+	if (c->closing || c->failed) return -1;
+
+	if (c->sent < c->sendLen) return submitWrite(c);
+	if (c->iovPos < c->iovCount) return submitToRing(c);
+
+	releaseBuffer(c);
+	return batchSent(c);
+}
+
+/*This function gives the registered buffer of a client back to the pool, and lets the 
+*first client that waits for one continue.
+*
+*Input: 
+*	a: client
+*
+*Return: none
+*/
+void releaseBuffer(struct client *c) {
+
+	if (c->buffer == -1) return;
+	freeBuffers[freeBufferCount++] = c->buffer;
+	c->buffer = -1;
+
+	for (struct client *w = clients; w != NULL; w = w->next) {
+		if (w->waiting && !w->closing) {
+			if (submitToRing(w) == -1) closeClient(w);
+			return;
+		}
+	}
+}
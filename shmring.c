@@ -0,0 +1,360 @@
+/*H**********************************************************************
+* FILENAME:		shmring.c
+*
+* COMPILE:		Make
+*
+* NOTES:
+*	RING:		The server is the only one that moves the tail and the
+*			klient the only one that moves the head, so both only
+*			need atomic loads and stores. They count bytes since the
+*			start, and the position in the ring is the count modulo
+*			its size. The frames are the same as on a socket, so the
+*			klient parses them the same way.
+*
+*			Each side keeps its own copy of the counter it moves, and
+*			checks the other one every time it is loaded: the other 
+*			side can write anything in the shared memory, and a count
+*			that is ahead of the own one or more than the size of the
+*			ring behind it would make the copies go past the ring. 
+*			The link is then given up.
+*
+*	WAKEUPS:	A side that can't go on, the klient with an empty ring
+*			or the server with a full one, sets its waiting flag,
+*			looks at the ring once more and then sleeps on its
+*			eventfd. The other side only writes the eventfd when it
+*			finds the flag set, so a busy stream needs no syscalls.
+*
+*	HANDOVER:	The memfd and both eventfds are sent to the klient with
+*			the answer to its HELLO, as SCM_RIGHTS on the Unix socket.
+*			The socket stays open for the requests, and for the 'Q'
+*			the server sends when it stops, wich the klient reads
+*			when the ring is empty.
+*
+*
+* AUTHOR: 		15119
+*
+*H*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "communication.h"
+#include "shmring.h"
+
+void wakeSide(uint32_t *waiting, int fd);
+int ringBroken(char *counter);
+
+/*This function makes the shared memory of a new link and its eventfds. If any of it
+*fails an error message is printed.
+*
+*Input:
+*	a: link to fill in
+*
+*Return:
+*0 on success, -1 for error
+*/
+int shmCreate(struct shmLink *l) {
+
+	memset(l, 0, sizeof(struct shmLink));
+	l->dataFd = l->spaceFd = -1;
+	if ((l->memFd = memfd_create("jobring", MFD_CLOEXEC)) == -1) {
+		perror("memfd_create()");
+		return -1;
+	}
+	if (ftruncate(l->memFd, SHMHEADERSIZE + SHMRINGSIZE) == -1) {
+		perror("ftruncate()");
+		shmClose(l);
+		return -1;
+	}
+	void *map = mmap(NULL, SHMHEADERSIZE + SHMRINGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, l->memFd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap()");
+		shmClose(l);
+		return -1;
+	}
+	l->h = map;
+	l->data = (char *) map + SHMHEADERSIZE;
+	l->size = l->h->size = SHMRINGSIZE;
+
+	if ((l->dataFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 || (l->spaceFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		perror("eventfd()");
+		shmClose(l);
+		return -1;
+	}
+	return 0;
+}
+
+/*This function sends the answer to a HELLO with the memfd and the eventfds of the link
+*attached. The answer is small and the socket empty, so it's sent in one go.
+*
+*Input:
+*	a: Unix socket
+*	b: answer
+*	c: length of the answer
+*	d: link
+*
+*Return:
+*0 on success, -1 for error
+*/
+int shmSendHello(int sock, char *hello, size_t length, struct shmLink *l) {
+
+	int fds[3] = {l->memFd, l->dataFd, l->spaceFd};
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = {hello, length};
+	struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	if (n != (ssize_t) length) {
+		if (n == -1) perror("sendmsg()");
+		else printf("Only sent %d of %d bytes of the hello\n", (int) n, (int) length);
+		return -1;
+	}
+	return 0;
+}
+
+/*This function reads the answer to a HELLO, and maps the shared memory if the server
+*sent a link with it. If it didn't the link is left empty.
+*
+*Input:
+*	a: Unix socket
+*	b: where the answer is stored
+*	c: length of the answer
+*	d: link to fill in
+*
+*Return:
+*0 on success, -1 for error
+*/
+int shmReceiveHello(int sock, char *hello, size_t length, struct shmLink *l) {
+
+	int fds[3];
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = {hello, length};
+	struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+	memset(l, 0, sizeof(struct shmLink));
+	l->memFd = l->dataFd = l->spaceFd = -1;
+
+	ssize_t n;
+	while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+	if (n <= 0) {
+		if (n == -1) perror("recvmsg()");
+		else printf("Server closed the connection\n");
+		return -1;
+	}
+	if ((size_t) n < length && readFromFileDescriptor(sock, hello + n, length - n) == -1) return -1;
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) return 0;
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	l->dataFd = fds[1];
+	l->spaceFd = fds[2];
+
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (fstat(fds[0], &st) == 0 && st.st_size == SHMHEADERSIZE + SHMRINGSIZE) {
+		map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	}
+	close(fds[0]);
+	if (map == MAP_FAILED) {
+		printf("Couldn't map the shared memory of the server\n");
+		shmClose(l);
+		return -1;
+	}
+	l->h = map;
+	l->data = (char *) map + SHMHEADERSIZE;
+	l->size = SHMRINGSIZE;
+	return 0;
+}
+
+/*This function puts as much of the entries as there is room for in the ring, and wakes
+*the klient if it sleeps. If there is no room at all the server is marked as waiting, so
+*the klient writes spaceFd when it has taken something.
+*
+*Input:
+*	a: link
+*	b: entries
+*	c: number of entries
+*
+*Return:
+*the number of bytes put in, -1 with errno EAGAIN if the ring is full, -1 with errno 
+*EPROTO if the klient broke the head
+*/
+ssize_t shmWritev(struct shmLink *l, struct iovec *iov, int count) {
+
+	struct shmHeader *h = l->h;
+	uint64_t tail = l->tail;
+	size_t total = 0;
+
+	for (int i = 0; i < count; i++) {
+
+		uint64_t used = tail - __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+		if (used > l->size) return ringBroken("head");
+		size_t room = l->size - used;
+		if (room == 0) {
+			if (total > 0) break;
+			__atomic_store_n(&h->writerWaiting, 1, __ATOMIC_SEQ_CST);
+			used = tail - __atomic_load_n(&h->head, __ATOMIC_SEQ_CST);
+			if (used > l->size) return ringBroken("head");
+			if (used == l->size) {
+				errno = EAGAIN;
+				return -1;
+			}
+			__atomic_store_n(&h->writerWaiting, 0, __ATOMIC_SEQ_CST);
+			i--;
+			continue;
+		}
+
+		size_t n = iov[i].iov_len < room ? iov[i].iov_len : room;
+		size_t pos = tail & (l->size - 1), first = n < l->size - pos ? n : l->size - pos;
+		memcpy(l->data + pos, iov[i].iov_base, first);
+		memcpy(l->data, (char *) iov[i].iov_base + first, n - first);
+		tail += n;
+		total += n;
+		if (n < iov[i].iov_len) break;
+	}
+
+	l->tail = tail;
+	__atomic_store_n(&h->tail, tail, __ATOMIC_SEQ_CST);
+	wakeSide(&h->readerWaiting, l->dataFd);
+	return total;
+}
+
+/*This function is the klient's side of fillRecvBuffer. It moves what is in the ring into
+*the receive buffer, after the bytes that aren't parsed yet. If the ring is empty the
+*klient sleeps until the server puts something in it, or until the socket is readable,
+*wich is the 'Q' or the server closing the connection. The socket is only read when the
+*ring is empty, so nothing in the ring is passed by.
+*
+*Input:
+*	a: link
+*	b: the Unix socket
+*	c: receive buffer
+*
+*Return:
+*the number of bytes received, 0 if the server closed the connection, -1 for error or if
+*the server broke the tail
+*/
+int shmFill(struct shmLink *l, int sock, struct recvBuffer *rb) {
+
+	struct shmHeader *h = l->h;
+	if (rb->start > 0) {
+		memmove(rb->data, rb->data + rb->start, rb->end - rb->start);
+		rb->end -= rb->start;
+		rb->start = 0;
+	}
+	if (rb->end == sizeof(rb->data)) {
+		printf("A frame is larger than the receive buffer (%d bytes)\n", RECVBUFSIZE);
+		return -1;
+	}
+
+	for (;;) {
+
+		uint64_t head = l->head, tail = __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE);
+		if (tail - head > l->size) return ringBroken("tail");
+		if (tail != head) {
+			size_t n = tail - head, room = sizeof(rb->data) - rb->end;
+			if (n > room) n = room;
+			size_t pos = head & (l->size - 1), first = n < l->size - pos ? n : l->size - pos;
+			memcpy(rb->data + rb->end, l->data + pos, first);
+			memcpy(rb->data + rb->end + first, l->data, n - first);
+			rb->end += n;
+
+			l->head = head + n;
+			__atomic_store_n(&h->head, l->head, __ATOMIC_SEQ_CST);
+			wakeSide(&h->writerWaiting, l->spaceFd);
+			return n;
+		}
+
+		/*The ring is empty*/
+		__atomic_store_n(&h->readerWaiting, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&h->tail, __ATOMIC_SEQ_CST) != head) {
+			__atomic_store_n(&h->readerWaiting, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		struct pollfd p[2] = {{l->dataFd, POLLIN, 0}, {sock, POLLIN, 0}};
+		int ready = poll(p, 2, -1);
+		__atomic_store_n(&h->readerWaiting, 0, __ATOMIC_SEQ_CST);
+		if (ready == -1) {
+			if (errno == EINTR) continue;
+			perror("poll()");
+			return -1;
+		}
+		if (p[0].revents & POLLIN) {
+			uint64_t count;
+			read(l->dataFd, &count, sizeof(count));
+			continue;
+		}
+		if (__atomic_load_n(&h->tail, __ATOMIC_ACQUIRE) != head) continue;
+
+		ssize_t n = recv(sock, rb->data + rb->end, sizeof(rb->data) - rb->end, 0);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			perror("recv()");
+			return -1;
+		}
+		rb->end += n;
+		return n;
+	}
+}
+
+/*This function unmaps the shared memory of a link and closes its descriptors.
+*
+*Input:
+*	a: link
+*
+*Return: none
+*/
+void shmClose(struct shmLink *l) {
+
+	if (l->h != NULL) munmap(l->h, SHMHEADERSIZE + SHMRINGSIZE);
+	if (l->memFd != -1) close(l->memFd);
+	if (l->dataFd != -1) close(l->dataFd);
+	if (l->spaceFd != -1) close(l->spaceFd);
+	l->h = NULL;
+	l->memFd = l->dataFd = l->spaceFd = -1;
+}
+
+/*This function tells that the other side has put a counter of the ring out of range.
+*
+*Input:
+*	a: name of the counter
+*
+*Return:
+*-1, with errno EPROTO
+*/
+int ringBroken(char *counter) {
+
+	printf("The %s of the shared memory ring is out of range\n", counter);
+	errno = EPROTO;
+	return -1;
+}
+
+/*This function wakes the other side if it is waiting. Only the one that clears the flag
+*writes the eventfd, so the other side is woken once.
+*
+*Input:
+*	a: waiting flag of the other side
+*	b: its eventfd
+*
+*Return: none
+*/
+void wakeSide(uint32_t *waiting, int fd) {
+
+	if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST) && __atomic_exchange_n(waiting, 0, __ATOMIC_SEQ_CST)) {
+		uint64_t one = 1;
+		write(fd, &one, sizeof(one));
+	}
+}
@@ -0,0 +1,48 @@
+/*H**********************************************************************
+* FILENAME:	shmring.h
+*
+* NOTES:	A byte stream from the server to a klient on the same host,
+*		through a ring in shared memory instead of a socket. The
+*		server makes the memory as a memfd and hands it to the
+*		klient over the Unix socket, with an eventfd for each
+*		direction that is only written when the other side sleeps.
+*
+* AUTHOR: 	15119
+*
+*H*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define SHMRINGSIZE (4 * 1024 * 1024)	//Must be a power of two
+#define SHMHEADERSIZE 4096		//The ring starts on the next page
+
+/*The start of the shared memory.*/
+struct shmHeader {
+	uint64_t head;			//Bytes the klient has taken, only written by it
+	uint64_t tail;			//Bytes the server has put in, only written by it
+	uint32_t readerWaiting;		//The klient sleeps on dataFd
+	uint32_t writerWaiting;		//The server waits for spaceFd
+	uint64_t size;
+};
+
+struct shmLink {
+	struct shmHeader *h;		//NULL if there is no link
+	char *data;
+	size_t size;
+	uint64_t head, tail;		//Own copy of the counter this side moves
+	int memFd;			//Only kept by the server, to hand it over
+	int dataFd;			//Written by the server when there is data
+	int spaceFd;			//Written by the klient when there is room
+};
+
+struct recvBuffer;
+
+int shmCreate(struct shmLink *l);
+int shmSendHello(int sock, char *hello, size_t length, struct shmLink *l);
+int shmReceiveHello(int sock, char *hello, size_t length, struct shmLink *l);
+ssize_t shmWritev(struct shmLink *l, struct iovec *iov, int count);
+int shmFill(struct shmLink *l, int sock, struct recvBuffer *rb);
+void shmClose(struct shmLink *l);
@@ -0,0 +1,384 @@
+/*H**********************************************************************
+* FILENAME:		sinks.c
+*
+* COMPILE:		Make
+*
+* NOTES:
+*	BUFFERS:	Every thread that executes jobs, a child or a worker,
+*			gets its own buffer the first time it writes, so adding
+*			a text is only a memcpy without locks. The buffer is
+*			written with one write() when the next text doesn't
+*			fit, so thousands of jobs cost one syscall instead of
+*			one each. A thread only executes jobs of one type, so a
+*			buffer only has one destination.
+*
+*	DESTINATIONS:	By default the texts of the first type go to stdout
+*			and the others to stderr. With a prefix every type gets
+*			a file <prefix>.<type> of its own. The files are opened
+*			with O_APPEND, so the buffers of several workers of a
+*			type are never written over each other.
+*
+*	FLUSHING:	FLUSHIDLE writes a buffer when its thread runs out of
+*			jobs, so the output of a batch shows up when the batch
+*			is done. FLUSHFULL only writes full buffers and the rest
+*			at the end, wich is the fastest for files. A policy of n
+*			ms also writes a buffer when a text is added and the
+*			oldest text in it has waited n ms.
+*
+*	ASYNC:		With an async writer a full buffer is handed to a
+*			writer thread, and the thread goes on with a second
+*			buffer while the first is written. It only waits if the
+*			second one is full before the first is written. There
+*			is one writer thread for every process, started the
+*			first time it's needed, since threads don't survive a
+*			fork().
+*
+*
+* AUTHOR: 		15119
+*
+*H*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include "sinks.h"
+
+struct sinkBuffer {
+	char *data;
+	size_t used;
+	int busy;			//Handed to the writer thread
+	int fd;
+	struct sinkBuffer *next;	//In the queue of the writer thread
+};
+
+struct sink {
+	struct sinkBuffer buffers[2];	//The second is only used with the writer thread
+	int current;
+	struct timespec oldest;		//When the first text in the current buffer was added
+	struct sink *next;
+};
+
+int sinkFds[MAXSINKS];
+int sinkCount, flushPolicy, asyncWrites;
+__thread struct sink *ownSink;
+struct sink *allSinks;
+pthread_mutex_t sinkLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sinkQueued = PTHREAD_COND_INITIALIZER;
+pthread_cond_t sinkWritten = PTHREAD_COND_INITIALIZER;
+struct sinkBuffer *queueHead, *queueTail;
+pthread_t writerThread;
+pid_t writerPid;	//Process the writer thread runs in, 0 if none
+int writerStop;
+
+struct sink * createSink(int type);
+void flushBuffer(struct sink *s);
+void waitWritten(struct sinkBuffer *b);
+int startWriter();
+void * writerTask(void *arg);
+void writeBuffer(struct sinkBuffer *b);
+
+/*This function chooses where the texts of every type go and how they are flushed. It
+*is called before the children are forked or the workers started, so they all share
+*the files. If a file can't be opened an error message is printed.
+*
+*Input:
+*	a: prefix of the output files, NULL for stdout and stderr
+*	b: the character of every type, used in the file names
+*	c: number of types
+*	d: FLUSHIDLE, FLUSHFULL or the age in ms
+*	e: 1 for the writer thread
+*
+*Return:
+*0 on success, -1 for error
+*/
+int sinkOpen(char *prefix, char *types, int count, int policy, int async) {
+
+	flushPolicy = policy;
+	asyncWrites = async;
+	for (sinkCount = 0; sinkCount < count && sinkCount < MAXSINKS; sinkCount++) {
+
+		if (prefix == NULL) {
+			sinkFds[sinkCount] = sinkCount == 0 ? STDOUT_FILENO : STDERR_FILENO;
+			continue;
+		}
+		char name[strlen(prefix) + 3];
+		sprintf(name, "%s.%c", prefix, types[sinkCount]);
+		if ((sinkFds[sinkCount] = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644)) == -1) {
+			perror("open()");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*This function adds a text and a newline to the buffer of the thread, and writes the
+*buffer first if the text doesn't fit. A text larger than a whole buffer is written
+*by itself, after the buffer that is with the writer thread, so the texts stay in order.
+*
+*Input:
+*	a: job type
+*	b: text, that doesn't have to end with a nullbyte
+*	c: length of the text
+*
+*Return: none
+*/
+void sinkWrite(int type, char *text, size_t length) {
+
+	struct sink *s = ownSink;
+	if (s == NULL && (s = ownSink = createSink(type)) == NULL) return;
+
+	struct sinkBuffer *b = &s->buffers[s->current];
+	if (b->used + length + 1 > SINKBUFSIZE) {
+		flushBuffer(s);
+		b = &s->buffers[s->current];
+	}
+	if (length + 1 > SINKBUFSIZE) {
+		waitWritten(&s->buffers[!s->current]);
+		struct iovec line[2] = {{text, length}, {"\n", 1}};
+		if (writev(b->fd, line, 2) == -1) perror("writev()");
+		return;
+	}
+
+	if (b->used == 0 && flushPolicy > 0) clock_gettime(CLOCK_MONOTONIC, &s->oldest);
+	memcpy(b->data + b->used, text, length);
+	b->data[b->used + length] = '\n';
+	b->used += length + 1;
+
+	if (flushPolicy > 0) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long waited = (now.tv_sec - s->oldest.tv_sec) * 1000 + (now.tv_nsec - s->oldest.tv_nsec) / 1000000;
+		if (waited >= flushPolicy) flushBuffer(s);
+	}
+}
+
+/*This function is called when the thread runs out of jobs, and writes its buffer
+*unless the policy is FLUSHFULL. When the thread stops it's called with force, wich
+*writes the buffer whatever the policy is.
+*
+*Input:
+*	a: 1 to write the buffer whatever the policy is
+*
+*Return: none
+*/
+void sinkFlush(int force) {
+
+	if (ownSink != NULL && (force || flushPolicy != FLUSHFULL)) flushBuffer(ownSink);
+}
+
+/*This function writes the current buffer of the thread straight away, without the
+*writer thread or any locks, so as much as possible is kept when a child is killed.
+*A buffer that is already with the writer thread may be lost.
+*
+*Input: none
+*
+*Return: none
+*/
+void sinkRescue() {
+
+	if (ownSink == NULL) return;
+	struct sinkBuffer *b = &ownSink->buffers[ownSink->current];
+	if (!b->busy && b->used > 0) writeBuffer(b);
+}
+
+/*This function writes what is left in the buffer of the thread, waits for the writer
+*thread to write every buffer it has been given and stops it. Then the buffers of every
+*thread in the process are freed, so it's only called when the others are done.
+*
+*Input: none
+*
+*Return: none
+*/
+void sinkClose() {
+
+	sinkFlush(1);
+	if (writerPid == getpid()) {
+		pthread_mutex_lock(&sinkLock);
+		writerStop = 1;
+		pthread_cond_signal(&sinkQueued);
+		pthread_mutex_unlock(&sinkLock);
+		pthread_join(writerThread, NULL);
+		writerPid = 0;
+	}
+
+	while (allSinks != NULL) {
+		struct sink *s = allSinks;
+		allSinks = s->next;
+		free(s->buffers[0].data);
+		free(s->buffers[1].data);
+		free(s);
+	}
+	ownSink = NULL;
+}
+
+/*This function allocates the buffers of a thread and adds them to the list of every
+*buffer in the process. If it fails an error message is printed.
+*
+*Input:
+*	a: job type of the thread
+*
+*Return:
+*the new sink, or NULL for error
+*/
+struct sink * createSink(int type) {
+
+	struct sink *s = calloc(1, sizeof(struct sink));
+	if (s == NULL) {
+		perror("calloc()");
+		return NULL;
+	}
+	for (int i = 0; i < 1 + asyncWrites; i++) {
+		if ((s->buffers[i].data = malloc(SINKBUFSIZE)) == NULL) {
+			perror("malloc()");
+			free(s->buffers[0].data);
+			free(s);
+			return NULL;
+		}
+		s->buffers[i].fd = sinkFds[type < sinkCount ? type : sinkCount - 1];
+	}
+
+	pthread_mutex_lock(&sinkLock);
+	s->next = allSinks;
+	allSinks = s;
+	pthread_mutex_unlock(&sinkLock);
+	return s;
+}
+
+/*This function writes the current buffer of a thread. Without the writer thread it is
+*written here. Otherwise it is queued for the writer thread, and the thread switches to
+*its other buffer, after waiting for the writer to be done with it.
+*
+*Input:
+*	a: sink of the thread
+*
+*Return: none
+*/
+void flushBuffer(struct sink *s) {
+
+	struct sinkBuffer *b = &s->buffers[s->current];
+	if (b->used == 0) return;
+	if (!asyncWrites || startWriter() == -1) {
+		writeBuffer(b);
+		return;
+	}
+
+	waitWritten(&s->buffers[!s->current]);
+	pthread_mutex_lock(&sinkLock);
+	b->busy = 1;
+	b->next = NULL;
+	if (queueTail != NULL) queueTail->next = b;
+	else queueHead = b;
+	queueTail = b;
+	pthread_cond_signal(&sinkQueued);
+	pthread_mutex_unlock(&sinkLock);
+	s->current = !s->current;
+}
+
+/*This function waits until the writer thread has written a buffer, if it was handed to
+*it.
+*
+*Input:
+*	a: buffer
+*
+*Return: none
+*/
+void waitWritten(struct sinkBuffer *b) {
+
+	if (!asyncWrites) return;
+	pthread_mutex_lock(&sinkLock);
+	while (b->busy) pthread_cond_wait(&sinkWritten, &sinkLock);
+	pthread_mutex_unlock(&sinkLock);
+}
+
+/*This function starts the writer thread of the process if it isn't running. If it
+*fails an error message is printed, and the buffers are written by the threads
+*themselves.
+*
+*Input: none
+*
+*Return:
+*0 on success, -1 for error
+*/
+int startWriter() {
+
+	if (writerPid == getpid()) return 0;
+
+	pthread_mutex_lock(&sinkLock);
+	if (writerPid != getpid()) {
+		writerStop = 0;
+		queueHead = queueTail = NULL;
+		if ((errno = pthread_create(&writerThread, NULL, writerTask, NULL)) != 0) {
+			perror("pthread_create()");
+			asyncWrites = 0;
+			pthread_mutex_unlock(&sinkLock);
+			return -1;
+		}
+		writerPid = getpid();
+	}
+	pthread_mutex_unlock(&sinkLock);
+	return 0;
+}
+
+/*This function is run by the writer thread. It writes the queued buffers in the order
+*they were queued, and wakes the threads waiting for their buffer to be written. It
+*stops when it is told to and the queue is empty.
+*
+*Input:
+*	a: not used
+*
+*Return:
+*NULL
+*/
+void * writerTask(void *arg) {
+
+	(void) arg;
+	pthread_mutex_lock(&sinkLock);
+	for (;;) {
+
+		while (queueHead == NULL && !writerStop) pthread_cond_wait(&sinkQueued, &sinkLock);
+		struct sinkBuffer *b = queueHead;
+		if (b == NULL) break;
+		if ((queueHead = b->next) == NULL) queueTail = NULL;
+
+		pthread_mutex_unlock(&sinkLock);
+		writeBuffer(b);
+		pthread_mutex_lock(&sinkLock);
+
+		b->busy = 0;
+		pthread_cond_broadcast(&sinkWritten);
+	}
+	pthread_mutex_unlock(&sinkLock);
+	return NULL;
+}
+
+/*This function writes a whole buffer to its destination and empties it. If it fails
+*an error message is printed and the texts are dropped.
+*
+*Input:
+*	a: buffer
+*
+*Return: none
+*/
+void writeBuffer(struct sinkBuffer *b) {
+
+	size_t done = 0;
+	while (done < b->used) {
+
+		ssize_t written = write(b->fd, b->data + done, b->used - done);
+		if (written == -1) {
+			if (errno == EINTR) continue;
+			perror("write()");
+			break;
+		}
+		done += written;
+	}
+	b->used = 0;
+}
@@ -0,0 +1,25 @@
+/*H**********************************************************************
+* FILENAME:	sinks.h
+*
+* NOTES:	Where the children and worker threads put the texts of
+*		their jobs. Every thread collects its texts in a large
+*		buffer of its own, wich is written with one write() when it
+*		is full, or earlier by the flush policy.
+*
+* AUTHOR: 	15119
+*
+*H*/
+
+#include <stddef.h>
+
+#define SINKBUFSIZE (128 * 1024)
+#define MAXSINKS 16
+#define FLUSHIDLE 0		//When the thread runs out of jobs
+#define FLUSHFULL -1		//Only when the buffer is full, and at the end
+				//A policy above 0 also flushes texts older than that many ms
+
+int sinkOpen(char *prefix, char *types, int count, int policy, int async);
+void sinkWrite(int type, char *text, size_t length);
+void sinkFlush(int force);
+void sinkRescue();
+void sinkClose();
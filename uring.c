@@ -0,0 +1,275 @@
+/*H**********************************************************************
+* FILENAME:		uring.c
+*
+* COMPILE:		Make
+*
+* NOTES: 	
+*	RING:		Sets up an io_uring instance and maps its submission 
+*			and completion queues. Submission queue entries are 
+*			handed out one by one and only submitted to the kernel
+*			by ringSubmit(), so everything that is prepared between 
+*			two calls costs one io_uring_enter() together.
+*
+*	CHAINS:		The kernel ends a chain of linked entries at the end of
+*			a submit, so a chain that is split between two submits 
+*			lets its last entry run before the first ones are done,
+*			and an entry with IOSQE_IO_LINK at the end of a submit 
+*			would be linked to whatever comes next. A chain is 
+*			therefore only built after ringReserve() has made room
+*			for all of it, and ringGetSqe() never submits by itself.
+*
+*	REGISTERING:	Files and buffers can be registered once, so that the
+*			kernel doesn't have to look them up for every request.
+*
+*
+* AUTHOR: 		15119
+*
+*H*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "uring.h"
+
+/*This function creates the io_uring instance and maps its queues. If any of it fails
+*an error message is printed.
+*
+*Input: 
+*	a: ring to fill in
+*	b: number of submission queue entries
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int ringInit(struct ring *r, unsigned entries) {
+
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	memset(r, 0, sizeof(struct ring));
+
+	if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) == -1) {
+		perror("io_uring_setup()");
+		return -1;
+	}
+
+	r->sqMapLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cqMapLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	r->sqMap = mmap(NULL, r->sqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->cqMap = mmap(NULL, r->cqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, r->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqMap == MAP_FAILED || r->cqMap == MAP_FAILED || r->sqes == MAP_FAILED) {
+		perror("mmap()");
+		ringClose(r);
+		return -1;
+	}
+
+	r->sqHead = (unsigned *)((char *) r->sqMap + p.sq_off.head);
+	r->sqTail = (unsigned *)((char *) r->sqMap + p.sq_off.tail);
+	r->sqMask = (unsigned *)((char *) r->sqMap + p.sq_off.ring_mask);
+	r->sqArray = (unsigned *)((char *) r->sqMap + p.sq_off.array);
+	r->cqHead = (unsigned *)((char *) r->cqMap + p.cq_off.head);
+	r->cqTail = (unsigned *)((char *) r->cqMap + p.cq_off.tail);
+	r->cqMask = (unsigned *)((char *) r->cqMap + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *) r->cqMap + p.cq_off.cqes);
+	r->sqEntries = p.sq_entries;
+	return 0;
+}
+
+/*This function unmaps the queues and closes the io_uring instance.
+*
+*Input: 
+*	a: ring
+*
+*Return: none
+*/
+void ringClose(struct ring *r) {
+
+	if (r->sqMap != NULL && r->sqMap != MAP_FAILED) munmap(r->sqMap, r->sqMapLen);
+	if (r->cqMap != NULL && r->cqMap != MAP_FAILED) munmap(r->cqMap, r->cqMapLen);
+	if (r->sqes != NULL && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqesLen);
+	if (r->fd > 0) close(r->fd);
+	memset(r, 0, sizeof(struct ring));
+	r->fd = -1;
+}
+
+/*This function hands out the next free submission queue entry, cleared. The entries
+*queued so far are never submitted here, room has to be made by ringReserve first.
+*
+*Input: 
+*	a: ring
+*
+*Return: 
+*the entry, NULL if the queue is full
+*/
+struct io_uring_sqe * ringGetSqe(struct ring *r) {
+
+	if (ringSpace(r) == 0) return NULL;
+
+	unsigned tail = *r->sqTail + r->queued;
+	unsigned index = tail & *r->sqMask;
+	struct io_uring_sqe *sqe = &r->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	r->sqArray[index] = index;
+	r->queued++;
+	return sqe;
+}
+
+/*This function tells how many submission queue entries can be handed out before the
+*queue has to be submitted.
+*
+*Input: 
+*	a: ring
+*
+*Return: 
+*number of free entries
+*/
+unsigned ringSpace(struct ring *r) {
+
+	return r->sqEntries - (*r->sqTail + r->queued - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE));
+}
+
+/*This function makes sure that count entries can be handed out without a submit in 
+*between, by submitting the entries queued so far if there isn't room for them. It 
+*has to be called before a chain is started, never in the middle of one.
+*
+*Input: 
+*	a: ring
+*	b: number of entries
+*
+*Return: 
+*0 on success, -1 for error or if the queue can't hold that many
+*/
+int ringReserve(struct ring *r, unsigned count) {
+
+	if (ringSpace(r) >= count) return 0;
+	if (ringSubmit(r) == -1) return -1;
+	if (ringSpace(r) >= count) return 0;
+	printf("The io_uring submission queue has no room for %u entries\n", count);
+	return -1;
+}
+
+/*This function makes the queued entries visible to the kernel and submits them all
+*with one io_uring_enter().
+*
+*Input: 
+*	a: ring
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int ringSubmit(struct ring *r) {
+
+	if (r->queued == 0) return 0;
+	__atomic_store_n(r->sqTail, *r->sqTail + r->queued, __ATOMIC_RELEASE);
+
+	unsigned toSubmit = r->queued;
+	r->queued = 0;
+	while (toSubmit > 0) {
+		int n = syscall(__NR_io_uring_enter, r->fd, toSubmit, 0, 0, NULL, 0);
+		if (n == -1) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+			perror("io_uring_enter()");
+			return -1;
+		}
+		toSubmit -= n;
+	}
+	return 0;
+}
+
+/*This function looks at the oldest completion without waiting for one.
+*
+*Input: 
+*	a: ring
+*
+*Return: 
+*the completion, NULL if there is none
+*/
+struct io_uring_cqe * ringPeekCqe(struct ring *r) {
+
+	unsigned head = *r->cqHead;
+	if (head == __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE)) return NULL;
+	return &r->cqes[head & *r->cqMask];
+}
+
+/*This function gives the oldest completion back to the kernel.
+*
+*Input: 
+*	a: ring
+*
+*Return: none
+*/
+void ringCqeSeen(struct ring *r) {
+
+	__atomic_store_n(r->cqHead, *r->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+/*This function registers a table of files. An entry of -1 leaves that slot empty
+*so that it can be filled in later by ringUpdateFile.
+*
+*Input: 
+*	a: ring
+*	b: file descriptors
+*	c: number of file descriptors
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int ringRegisterFiles(struct ring *r, int *fds, unsigned count) {
+
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, fds, count) == -1) {
+		perror("io_uring_register()");
+		return -1;
+	}
+	return 0;
+}
+
+/*This function puts a file into one slot of the registered file table, -1 empties it.
+*
+*Input: 
+*	a: ring
+*	b: slot
+*	c: file descriptor
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int ringUpdateFile(struct ring *r, unsigned slot, int fd) {
+
+	struct io_uring_files_update update;
+	memset(&update, 0, sizeof(update));
+	update.offset = slot;
+	update.fds = (unsigned long) &fd;
+
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == -1) {
+		perror("io_uring_register()");
+		return -1;
+	}
+	return 0;
+}
+
+/*This function registers buffers, wich can then be used by the fixed read and
+*write operations.
+*
+*Input: 
+*	a: ring
+*	b: buffers
+*	c: number of buffers
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int ringRegisterBuffers(struct ring *r, struct iovec *iov, unsigned count) {
+
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, count) == -1) {
+		perror("io_uring_register()");
+		return -1;
+	}
+	return 0;
+}
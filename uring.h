@@ -0,0 +1,35 @@
+/*H**********************************************************************
+* FILENAME:	uring.h
+*
+* NOTES:	A minimal io_uring instance made directly on top of the 
+*		system calls, since liburing isn't available everywhere.
+*
+* AUTHOR: 	15119
+*
+*H*/
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+struct ring {
+	int fd;
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+	unsigned *cqHead, *cqTail, *cqMask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned sqEntries, queued;	//queued are filled in, but not yet submitted
+	void *sqMap, *cqMap;
+	size_t sqMapLen, cqMapLen, sqesLen;
+};
+
+int ringInit(struct ring *r, unsigned entries);
+void ringClose(struct ring *r);
+struct io_uring_sqe * ringGetSqe(struct ring *r);
+unsigned ringSpace(struct ring *r);
+int ringReserve(struct ring *r, unsigned count);
+int ringSubmit(struct ring *r);
+struct io_uring_cqe * ringPeekCqe(struct ring *r);
+void ringCqeSeen(struct ring *r);
+int ringRegisterFiles(struct ring *r, int *fds, unsigned count);
+int ringUpdateFile(struct ring *r, unsigned slot, int fd);
+int ringRegisterBuffers(struct ring *r, struct iovec *iov, unsigned count);
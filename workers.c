@@ -0,0 +1,317 @@
+/*H**********************************************************************
+* FILENAME:		workers.c
+*
+* COMPILE:		Make
+*
+* NOTES: 	
+*	RINGS:		The parent is the only one that adds to a ring, so the
+*			tail only needs atomic loads and stores. The jobs of a
+*			type are spread round-robin over the rings of its workers.
+*
+*	STEALING:	A worker with an empty ring takes the oldest job from
+*			the ring of another worker of the same type. Since more
+*			than one worker can take from a ring, the head is moved
+*			forward with compare-and-swap. Stealing is turned off 
+*			in ordered mode, where every job of a type goes to the
+*			first worker of that type, so the jobs of a type are
+*			executed in the order they were received.
+*
+*	WAKEUPS:	A worker with an empty ring marks itself as sleeping and
+*			blocks on its eventfd. The parent doesn't wake it for 
+*			every job, only in wakeWorkers(), wich it calls before it
+*			blocks itself. So a whole received chunk of jobs costs at
+*			most one wakeup per worker. In the same way the parent 
+*			sleeps on its own eventfd when a ring is full or when it
+*			waits for a buffer to be released.
+*
+*	IDLE:		Before a worker sleeps, and when it stops, the idle
+*			function is called, so the worker can flush what it
+*			has buffered while there is nothing else to do.
+*
+*
+* AUTHOR: 		15119
+*
+*H*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "workers.h"
+
+struct jobRing *rings;
+pthread_t *workerThreads;
+int workerCount, parentWakeFd, parentSleeping;
+int typeCount, ringsPerType, orderedJobs;
+int *nextWorker;	//Round-robin position of every type
+jobHandler handleJob;
+idleHandler handleIdle;
+
+void * workerTask(void *arg);
+int takeJob(struct jobRing *r, struct job *j, int steal);
+int stealJob(int worker, struct job *j);
+void sleepOn(int fd, int *sleeping);
+void wake(int fd, int *sleeping);
+
+/*This function allocates a ring for perType workers of every type and starts a worker
+*thread for each of them. If any of it fails an error message is printed.
+*
+*Input: 
+*	a: number of job types
+*	b: number of workers for every type
+*	c: 1 if the jobs of a type have to be executed in order
+*	d: function that executes a job
+*	e: function called when a worker runs out of jobs or stops, or NULL
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int startWorkers(int types, int perType, int ordered, jobHandler handler, idleHandler idle) {
+
+	int count = types * perType;
+	handleJob = handler;
+	handleIdle = idle;
+	typeCount = types;
+	ringsPerType = perType;
+	orderedJobs = ordered;
+	rings = calloc(count, sizeof(struct jobRing));
+	workerThreads = calloc(count, sizeof(pthread_t));
+	nextWorker = calloc(types, sizeof(int));
+	if (rings == NULL || workerThreads == NULL || nextWorker == NULL) {
+		perror("calloc()");
+		return -1;
+	}
+	if ((parentWakeFd = eventfd(0, 0)) == -1) {
+		perror("eventfd()");
+		return -1;
+	}
+
+	for (int i = 0; i < count; i++) {
+		if ((rings[i].wakeFd = eventfd(0, 0)) == -1) {
+			perror("eventfd()");
+			return -1;
+		}
+		if ((errno = pthread_create(&workerThreads[i], NULL, workerTask, (void *)(intptr_t) i)) != 0) {
+			perror("pthread_create()");
+			return -1;
+		}
+		workerCount++;
+	}
+	return 0;
+}
+
+/*This function puts a job in the ring of the next worker of its type. If the ring is 
+*full the worker is woken and the parent sleeps until there is room.
+*
+*Input: 
+*	a: job type, or the worker when it is stopped
+*	b: job text, NULL to stop the worker
+*	c: length of the text
+*	d: counter that the worker decrements when it is done with the text
+*
+*Return: 
+*0 on success, -1 for error
+*/
+int handToWorker(int type, char *text, int length, int *release) {
+
+	int worker = type;
+	if (text != NULL) {
+		worker = type * ringsPerType;
+		if (!orderedJobs) {
+			worker += nextWorker[type];
+			nextWorker[type] = (nextWorker[type] + 1) % ringsPerType;
+		}
+	}
+	struct jobRing *r = &rings[worker];
+
+	while (r->tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == RINGSIZE) {
+		wakeWorkers();
+		__atomic_store_n(&parentSleeping, 1, __ATOMIC_SEQ_CST);
+		if (r->tail - __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) == RINGSIZE) sleepOn(parentWakeFd, &parentSleeping);
+		else __atomic_store_n(&parentSleeping, 0, __ATOMIC_SEQ_CST);
+	}
+
+	struct job *j = &r->slots[r->tail & (RINGSIZE - 1)];
+	j->text = text;
+	j->length = length;
+	j->release = release;
+	if (release != NULL) __atomic_add_fetch(release, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*This function wakes every sleeping worker that has been given jobs since it was last
+*woken.
+*
+*Input: none
+*
+*Return: none
+*/
+void wakeWorkers() {
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (int i = 0; i < workerCount; i++) {
+		struct jobRing *r = &rings[i];
+		if (r->published == r->tail) continue;
+		r->published = r->tail;
+		wake(r->wakeFd, &r->sleeping);
+	}
+}
+
+/*This function waits until the workers are done with every job that refers to a
+*counter, wich is when the buffer the jobs point into can be used again.
+*
+*Input: 
+*	a: counter
+*
+*Return: 
+*0 on success
+*/
+int waitForRelease(int *counter) {
+
+	wakeWorkers();
+	while (__atomic_load_n(counter, __ATOMIC_ACQUIRE) != 0) {
+		__atomic_store_n(&parentSleeping, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(counter, __ATOMIC_SEQ_CST) != 0) sleepOn(parentWakeFd, &parentSleeping);
+		else __atomic_store_n(&parentSleeping, 0, __ATOMIC_SEQ_CST);
+	}
+	return 0;
+}
+
+/*This function gives every worker a job with no text, wich makes it stop, and waits 
+*for all of them to finish.
+*
+*Input: none
+*
+*Return: none
+*/
+void stopWorkers() {
+
+	for (int i = 0; i < workerCount; i++) handToWorker(i, NULL, 0, NULL);
+	free(nextWorker);
+	nextWorker = NULL;
+	wakeWorkers();
+	for (int i = 0; i < workerCount; i++) pthread_join(workerThreads[i], NULL);
+	workerCount = 0;
+}
+
+/*This function is run by every worker thread. It takes jobs from its ring, or steals them
+*from the other workers of its type when it is empty, and executes them until it gets a 
+*job with no text. After a job the counter of its buffer is decremented, and the parent 
+*is woken if it sleeps.
+*
+*Input: 
+*	a: number of the worker
+*
+*Return: 
+*NULL
+*/
+void * workerTask(void *arg) {
+
+	int worker = (intptr_t) arg;
+	struct jobRing *r = &rings[worker];
+	struct job j;
+
+	for (;;) {
+
+		while (takeJob(r, &j, 0) == 0 && stealJob(worker, &j) == 0) {
+			if (handleIdle != NULL) handleIdle(0);
+			__atomic_store_n(&r->sleeping, 1, __ATOMIC_SEQ_CST);
+			if (takeJob(r, &j, 0) == 1) {
+				__atomic_store_n(&r->sleeping, 0, __ATOMIC_SEQ_CST);
+				break;
+			}
+			sleepOn(r->wakeFd, &r->sleeping);
+		}
+		if (j.text == NULL) {
+			if (handleIdle != NULL) handleIdle(1);
+			return NULL;
+		}
+
+		handleJob(worker / ringsPerType, j.text, j.length);
+		__atomic_sub_fetch(j.release, 1, __ATOMIC_SEQ_CST);
+		wake(parentWakeFd, &parentSleeping);
+	}
+}
+
+/*This function takes the oldest job from a ring. The job is read before the head is moved
+*past it, and only counts if no other worker moved the head in the meantime. A job with no
+*text is never stolen, since it stops the worker that owns the ring.
+*
+*Input: 
+*	a: ring
+*	b: where the job is stored
+*	c: 1 if the ring belongs to another worker
+*
+*Return: 
+*1 if a job was taken, 0 if the ring is empty
+*/
+int takeJob(struct jobRing *r, struct job *j, int steal) {
+
+	unsigned head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	do {
+		if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) return 0;
+		*j = r->slots[head & (RINGSIZE - 1)];
+		if (steal && j->text == NULL) return 0;
+	} while (!__atomic_compare_exchange_n(&r->head, &head, head + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	return 1;
+}
+
+/*This function steals the oldest job of the first other worker of the same type that 
+*has one.
+*
+*Input: 
+*	a: worker that steals
+*	b: where the job is stored
+*
+*Return: 
+*1 if a job was stolen, 0 if there was nothing to steal
+*/
+int stealJob(int worker, struct job *j) {
+
+	if (orderedJobs) return 0;
+
+	int first = worker - worker % ringsPerType;
+	for (int i = 1; i < ringsPerType; i++) {
+		int victim = first + (worker - first + i) % ringsPerType;
+		if (takeJob(&rings[victim], j, 1) == 1) return 1;
+	}
+	return 0;
+}
+
+/*This function blocks on an eventfd until someone wakes it.
+*
+*Input: 
+*	a: eventfd
+*	b: flag that tells the others that this thread sleeps
+*
+*Return: none
+*/
+void sleepOn(int fd, int *sleeping) {
+
+	uint64_t value;
+	while (read(fd, &value, sizeof(value)) == -1 && errno == EINTR);
+	__atomic_store_n(sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+/*This function wakes a thread if it sleeps. Only the first one to see that it sleeps
+*writes to its eventfd.
+*
+*Input: 
+*	a: eventfd
+*	b: flag that tells if the thread sleeps
+*
+*Return: none
+*/
+void wake(int fd, int *sleeping) {
+
+	uint64_t value = 1;
+	if (__atomic_load_n(sleeping, __ATOMIC_SEQ_CST) && __atomic_exchange_n(sleeping, 0, __ATOMIC_SEQ_CST)) {
+		while (write(fd, &value, sizeof(value)) == -1 && errno == EINTR);
+	}
+}
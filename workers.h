@@ -0,0 +1,37 @@
+/*H**********************************************************************
+* FILENAME:	workers.h
+*
+* NOTES:	A pool of worker threads in the klient process, with a group
+*		of workers for every job type. Every worker is fed by its 
+*		own lock-free ring of jobs, and a job is only a pointer into 
+*		the buffer it was received in.
+*
+* AUTHOR: 	15119
+*
+*H*/
+
+#define RINGSIZE 1024	//Must be a power of two
+
+struct job {
+	char *text;		//NULL tells the worker to stop
+	int length;
+	int *release;		//Decremented when the worker is done with text
+};
+
+struct jobRing {
+	struct job slots[RINGSIZE];
+	unsigned head;		//Next slot to take, only written by the worker
+	unsigned tail;		//Next slot to fill, only written by the parent
+	unsigned published;	//tail when the worker was last woken
+	int sleeping;
+	int wakeFd;
+};
+
+typedef void (*jobHandler)(int type, char *text, int length);
+typedef void (*idleHandler)(int stopping);
+
+int startWorkers(int types, int perType, int ordered, jobHandler handler, idleHandler idle);
+int handToWorker(int type, char *text, int length, int *release);
+void wakeWorkers();
+int waitForRelease(int *counter);
+void stopWorkers();